@@ -0,0 +1,110 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator over a list of blocks. Everything is released at once by
+// reset(), which keeps the blocks for reuse: once an arena has grown to the
+// size of its workload it no longer touches the heap. Destructors are never
+// run, so only trivially destructible types can be allocated.
+struct Arena {
+    static const size_t default_block_size = 64 * 1024;
+
+    explicit Arena(size_t block_size = default_block_size) : block_size(block_size) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t bytes, size_t alignment) {
+	while (current < blocks.size()) {
+	    Block& block = blocks[current];
+	    uintptr_t base = (uintptr_t)block.data.get();
+	    uintptr_t aligned = (base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	    if (aligned + bytes <= base + block.size) {
+		offset = aligned + bytes - base;
+		return (void*)aligned;
+	    }
+	    ++current;
+	    offset = 0;
+	}
+
+	// Oversized requests get a block of their own.
+	size_t size = std::max(block_size, bytes + alignment);
+	blocks.push_back(Block{std::unique_ptr<char[]>(new char[size]), size});
+	++block_allocations;
+	return allocate(bytes, alignment);
+    }
+
+    // Default-constructed array of count elements.
+    template <typename U>
+    U* allocate_array(size_t count) {
+	static_assert(std::is_trivially_destructible<U>::value, "arena memory is released without running destructors");
+	U* array = (U*)allocate(count * sizeof(U), alignof(U));
+	for (size_t i = 0;i < count;++i) {
+	    new (&array[i]) U();
+	}
+	return array;
+    }
+
+    void reset() {
+	current = 0;
+	offset = 0;
+    }
+
+    // Position of the next allocation. Rewinding to it releases everything
+    // allocated since.
+    struct Marker {
+	size_t block;
+	size_t offset;
+    };
+
+    Marker mark() const {
+	return Marker{current, offset};
+    }
+
+    void rewind(const Marker& marker) {
+	current = marker.block;
+	offset = marker.offset;
+    }
+
+    size_t capacity() const {
+	size_t bytes = 0;
+	for (const auto& block : blocks) bytes += block.size;
+	return bytes;
+    }
+
+    // Number of blocks taken from the heap over the lifetime of the arena.
+    size_t block_allocations = 0;
+
+private:
+    struct Block {
+	std::unique_ptr<char[]> data;
+	size_t size;
+    };
+
+    size_t block_size;
+    std::vector<Block> blocks;
+    size_t current = 0;
+    size_t offset = 0;
+};
+
+// Scratch memory of the calling thread, reset by the renderer after every
+// tile.
+inline Arena& thread_arena() {
+    thread_local Arena arena;
+    return arena;
+}
+
+// Memory living for one frame, reset when a render starts.
+inline Arena& frame_arena() {
+    static Arena arena(1024 * 1024);
+    return arena;
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef BAKED_SCENE_HPP
+#define BAKED_SCENE_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "geometry.hpp"
+#include "material.hpp"
+#include "sphere.hpp"
+#include "shape.hpp"
+#include "light.hpp"
+#include "scene.hpp"
+
+// Scenes fixed at compile time. A baked scene is a type holding its
+// materials, spheres, rectangles and lights in static constexpr arrays;
+// intersect_baked() tests its primitives in one unrolled sequence, where
+// every center, radius, edge and normal is a constant folded into the code.
+// fill_baked_scene() copies the arrays into a Scene, which make_baked_scene()
+// also hooks the baked test into in place of the acceleration structures.
+// The default scene is defined here once, and built either way.
+
+struct BakedMaterial {
+    double refraction_index;
+    Vec4d albedo;
+    Vec3d diffuse_color;
+    double specular_exponent;
+    TextureType texture = TextureType::Constant;
+    Vec3d texture_color = Vec3d();
+    double texture_frequency = 1;
+};
+
+struct BakedSphere {
+    Vec3d center;
+    double radius;
+    uint32_t material;
+};
+
+struct BakedRectangle {
+    Vec3d corner;
+    Vec3d edge_u;
+    Vec3d edge_v;
+    uint32_t material;
+};
+
+struct BakedLight {
+    Vec3d position;
+    double intensity;
+};
+
+// Square root by Newton's method, which std::sqrt() is not constexpr for.
+constexpr double constexpr_sqrt(double x) {
+    if (x <= 0) return 0;
+    double root = x > 1 ? x : 1;
+    for (int i = 0;i < 64;++i) {
+	double next = (root + x / root) / 2;
+	if (next >= root) break;
+	root = next;
+    }
+    return root;
+}
+
+constexpr Vec3d baked_normal(const BakedRectangle& rectangle) {
+    Vec3d normal = cross(rectangle.edge_u, rectangle.edge_v);
+    return normal / constexpr_sqrt(normal * normal);
+}
+
+template <typename T>
+constexpr Vec3<T> baked_vector(const Vec3d& v) {
+    return Vec3<T>(T(v.x), T(v.y), T(v.z));
+}
+
+// The default scene: four spheres on a checkered ground, under three lights.
+struct DefaultBakedScene {
+    static constexpr std::array<BakedMaterial, 5> materials{{
+	// Ivory, glass, red rubber, mirror and the checkerboard.
+	{1.0, Vec4d(0.6, 0.3, 0.1, 0.0), Vec3d(0.4, 0.4, 0.3), 50},
+	{1.05, Vec4d(0.1, 0.9, 0.1, 0.8), Vec3d(0.9, 0.1, 0.1), 1205},
+	{1.0, Vec4d(0.9, 0.1, 0.0, 0.0), Vec3d(0.3, 0.1, 0.1), 10},
+	{1.0, Vec4d(0.0, 10.0, 0.8, 0.0), Vec3d(1.0, 1.0, 1.0), 1425},
+	{1.0, Vec4d(1, 0, 0, 0), Vec3d(0.3, 0.3, 0.3), 0, TextureType::Checker, Vec3d(0.3, 0.09, 0.21), 0.5},
+    }};
+    static constexpr std::array<BakedSphere, 4> spheres{{
+	{Vec3d(-3, 0, -16), 2, 0},
+	{Vec3d(-1.0, -1.5, -12), 2, 1},
+	{Vec3d(1.5, -0.5, -18), 3, 2},
+	{Vec3d(7, 5, -18), 4, 3},
+    }};
+    static constexpr std::array<BakedRectangle, 1> rectangles{{
+	{Vec3d(-20, -4, -10), Vec3d(40, 0, 0), Vec3d(0, 0, -40), 4},
+    }};
+    static constexpr std::array<BakedLight, 3> lights{{
+	{Vec3d(-20, 20,  20), 1.5},
+	{Vec3d( 30, 50, -25), 1.8},
+	{Vec3d( 30, 20,  30), 1.7},
+    }};
+};
+
+template <typename Baked, size_t I, typename T>
+inline void intersect_baked_sphere(const Vec3<T>& origin, const Vec3<T>& direction, T& t, uint32_t& hit) {
+    constexpr BakedSphere sphere = Baked::spheres[I];
+    T dist;
+    if (sphere_intersect(baked_vector<T>(sphere.center), T(sphere.radius), origin, direction, dist) && dist < t) {
+	t = dist;
+	hit = (uint32_t)I;
+    }
+}
+
+template <typename Baked, size_t I, typename T>
+inline void intersect_baked_rectangle(const Vec3<T>& origin, const Vec3<T>& direction, T& t, uint32_t& hit) {
+    constexpr BakedRectangle rectangle = Baked::rectangles[I];
+    constexpr Vec3d normal = baked_normal(rectangle);
+    T dist;
+    if (rectangle_intersect(baked_vector<T>(rectangle.corner), baked_vector<T>(rectangle.edge_u), baked_vector<T>(rectangle.edge_v),
+			    baked_vector<T>(normal), origin, direction, dist) && dist < t) {
+	t = dist;
+	hit = (uint32_t)(Baked::spheres.size() + I);
+    }
+}
+
+template <typename Baked, typename T, size_t... Spheres, size_t... Rectangles>
+inline uint32_t intersect_baked(const Vec3<T>& origin, const Vec3<T>& direction, T& t,
+				std::index_sequence<Spheres...>, std::index_sequence<Rectangles...>) {
+    uint32_t hit = Scene<T>::no_primitive;
+    (intersect_baked_sphere<Baked, Spheres>(origin, direction, t, hit), ...);
+    (intersect_baked_rectangle<Baked, Rectangles>(origin, direction, t, hit), ...);
+    return hit;
+}
+
+// Closest primitive of the baked scene hit before t, numbered like those of
+// a Scene: spheres first, then rectangles.
+template <typename Baked, typename T>
+uint32_t intersect_baked(const Vec3<T>& origin, const Vec3<T>& direction, T& t) {
+    return intersect_baked<Baked>(origin, direction, t, std::make_index_sequence<Baked::spheres.size()>(),
+				  std::make_index_sequence<Baked::rectangles.size()>());
+}
+
+template <typename T>
+Material<T> make_baked_material(const BakedMaterial& baked) {
+    Material<T> material(T(baked.refraction_index), Vec4<T>(T(baked.albedo.x), T(baked.albedo.y), T(baked.albedo.z), T(baked.albedo.w)),
+			 baked_vector<T>(baked.diffuse_color), T(baked.specular_exponent));
+    if (baked.texture != TextureType::Constant) {
+	material.texture = Texture<T>(baked.texture, baked_vector<T>(baked.texture_color), T(baked.texture_frequency));
+    }
+    return material;
+}
+
+// Fills an empty scene with the primitives and lights of a baked one, to be
+// traced like any other.
+template <typename Baked, typename T>
+void fill_baked_scene(Scene<T>& scene) {
+    for (const BakedSphere& sphere : Baked::spheres) {
+	scene.spheres.push_back(Sphere<T>(baked_vector<T>(sphere.center), T(sphere.radius), make_baked_material<T>(Baked::materials[sphere.material])));
+    }
+    for (const BakedRectangle& rectangle : Baked::rectangles) {
+	scene.rectangles.push_back(Rectangle<T>(baked_vector<T>(rectangle.corner), baked_vector<T>(rectangle.edge_u), baked_vector<T>(rectangle.edge_v),
+						make_baked_material<T>(Baked::materials[rectangle.material])));
+    }
+    for (const BakedLight& light : Baked::lights) {
+	scene.lights.push_back(Light<T>(baked_vector<T>(light.position), T(light.intensity)));
+    }
+}
+
+// Fills an empty scene, found by the baked test. Spheres must not be moved
+// afterwards, nor bounded primitives added: the baked test would not see
+// them.
+template <typename Baked, typename T>
+void make_baked_scene(Scene<T>& scene) {
+    fill_baked_scene<Baked>(scene);
+    scene.baked_intersect = &intersect_baked<Baked, T>;
+}
+
+template <typename T>
+void make_default_scene(Scene<T>& scene) {
+    fill_baked_scene<DefaultBakedScene>(scene);
+}
+
+#endif
@@ -0,0 +1,1018 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <vector>
+#include <omp.h>
+
+#include "geometry.hpp"
+#include "scene.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "envmap.hpp"
+#include "envmap_cache.hpp"
+#include "render.hpp"
+#include "baked_scene.hpp"
+
+// Test hook: heap allocations through every form of operator new, plain or
+// aligned, throwing or not, are counted while count_allocations is set.
+std::atomic<bool> count_allocations{false};
+std::atomic<size_t> allocation_count{0};
+
+// Null if out of memory.
+void* counted_allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+    if (count_allocations) ++allocation_count;
+    if (size == 0) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void* counted_allocate_or_throw(size_t size, size_t alignment = alignof(std::max_align_t)) {
+    if (void* p = counted_allocate(size, alignment)) return p;
+    throw std::bad_alloc();
+}
+
+// Out of line, so that the compiler never sees free() next to the
+// operator new the pointer came from, which -Wmismatched-new-delete flags.
+[[gnu::noinline]] void counted_free(void* p) noexcept {
+    std::free(p);
+}
+
+void* operator new(size_t size) { return counted_allocate_or_throw(size); }
+void* operator new[](size_t size) { return counted_allocate_or_throw(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return counted_allocate_or_throw(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return counted_allocate_or_throw(size, (size_t)alignment); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return counted_allocate(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return counted_allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return counted_allocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return counted_allocate(size, (size_t)alignment); }
+
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { counted_free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { counted_free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { counted_free(p); }
+
+// Best wall-clock time of several runs, in milliseconds.
+template <typename F>
+double time_ms(int runs, F&& f) {
+    double best = std::numeric_limits<double>::max();
+    for (int run = 0;run < runs;++run) {
+	auto start = std::chrono::steady_clock::now();
+	f();
+	auto end = std::chrono::steady_clock::now();
+	best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+template <typename T>
+double bench_precision(const char* name, const Envmap& envmap, int width, int height, int runs, Framebuffer<T>& framebuffer) {
+    Scene<T> scene;
+    make_default_scene(scene);
+
+    double ms = time_ms(runs, [&]() { render(framebuffer, width, height, scene, envmap); });
+    std::cout << name << ": " << ms << " ms, "
+	      << (double)width * height / (ms * 1e3) << " Mprimary/s" << std::endl;
+    return ms;
+}
+
+template <typename A, typename B>
+double mean_abs_difference(const Framebuffer<A>& a, const Framebuffer<B>& b) {
+    double error = 0;
+    for (size_t i = 0;i < a.size();++i) {
+	Vec3<A> color_a = a.load(i);
+	Vec3<B> color_b = b.load(i);
+	for (int c = 0;c < 3;++c) {
+	    error += std::fabs((double)color_a[c] - (double)color_b[c]);
+	}
+    }
+    return error / (3.0 * a.size());
+}
+
+void bench_precisions(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== precision" << std::endl;
+    Framebuffer<float> framebuffer_float;
+    Framebuffer<double> framebuffer_double;
+    double float_ms = bench_precision("float ", envmap, width, height, runs, framebuffer_float);
+    double double_ms = bench_precision("double", envmap, width, height, runs, framebuffer_double);
+    std::cout << "double/float: " << double_ms / float_ms << "x" << std::endl;
+    std::cout << "mean abs float/double difference: " << mean_abs_difference(framebuffer_float, framebuffer_double) << std::endl;
+}
+
+// Renders the default scene into every framebuffer format and times a pass
+// reading the whole image back, like accumulation or tone mapping would.
+void bench_framebuffer_formats(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== framebuffer formats" << std::endl;
+    Scene<float> scene;
+    make_default_scene(scene);
+    scene.build_accelerator();
+
+    const FramebufferFormat formats[] = {FramebufferFormat::Full, FramebufferFormat::Half, FramebufferFormat::RGBE};
+    const char* names[] = {"full", "half", "rgbe"};
+    Framebuffer<float> full(FramebufferFormat::Full);
+    for (int f = 0;f < 3;++f) {
+	Framebuffer<float> framebuffer(formats[f]);
+	double render_ms = time_ms(runs, [&]() { render(framebuffer, width, height, scene, envmap); });
+	Vec3f sum(0, 0, 0);
+	double read_ms = time_ms(runs, [&]() {
+	    for (size_t i = 0;i < framebuffer.size();++i) sum = sum + framebuffer.load(i);
+	});
+	if (f == 0) full = framebuffer;
+	std::cout << names[f] << ": " << framebuffer.pixel_bytes() << " bytes/pixel, render " << render_ms << " ms, read "
+		  << read_ms << " ms, mean abs difference to full " << mean_abs_difference(framebuffer, full)
+		  << " (sum " << sum.x + sum.y + sum.z << ")" << std::endl;
+    }
+}
+
+// Renders the default scene with several samples per pixel on one and on
+// four threads, which must give the same image bit for bit, and checks that
+// two accumulated renders match one render with all the samples. Those only
+// differ by the rounding of the running mean, so a mean difference above
+// 1e-6, a few float ulps of the unit range, fails.
+bool bench_sample_reproducibility(const Envmap& envmap, int width, int height) {
+    const int samples = 4;
+    std::cout << "== " << samples << " samples per pixel" << std::endl;
+    Scene<float> scene;
+    make_default_scene(scene);
+    scene.build_accelerator();
+
+    RenderSettings settings;
+    settings.samples = samples;
+    const int max_threads = omp_get_max_threads();
+    const int thread_counts[] = {1, 4};
+    Framebuffer<float> framebuffers[2];
+    for (int t = 0;t < 2;++t) {
+	omp_set_num_threads(thread_counts[t]);
+	double ms = time_ms(1, [&]() { render(framebuffers[t], width, height, scene, envmap, settings); });
+	std::cout << thread_counts[t] << " threads: " << ms << " ms, " << (double)width * height * samples / (ms * 1e3) << " Msamples/s" << std::endl;
+    }
+    omp_set_num_threads(max_threads);
+
+    Framebuffer<float> accumulated;
+    settings.samples = samples / 2;
+    render(accumulated, width, height, scene, envmap, settings);
+    settings.first_sample = samples / 2;
+    render(accumulated, width, height, scene, envmap, settings);
+    const double accumulation_difference = mean_abs_difference(accumulated, framebuffers[0]);
+    std::cout << "mean abs difference of two accumulated renders: " << accumulation_difference << std::endl;
+
+    if (framebuffers[0].data != framebuffers[1].data) {
+	std::cerr << "renders differ with the number of threads" << std::endl;
+	return false;
+    }
+    if (!(accumulation_difference <= 1e-6)) {
+	std::cerr << "accumulated renders differ from one render with all the samples" << std::endl;
+	return false;
+    }
+    return true;
+}
+
+// Soft shadows of the default scene lit by area lights, spending their whole
+// sample budget everywhere or only in penumbra.
+void bench_soft_shadows(const Envmap& envmap, int width, int height, int runs) {
+    const int light_samples = 16;
+    std::cout << "== area lights, " << light_samples << " samples" << std::endl;
+    Scene<float> scene;
+    make_default_scene(scene);
+    make_area_lights(scene, 6.0f, light_samples);
+    scene.build_accelerator();
+
+    RenderSettings settings;
+    Framebuffer<float> uniform, adaptive;
+    settings.adaptive_shadows = false;
+    double uniform_ms = time_ms(runs, [&]() { render(uniform, width, height, scene, envmap, settings); });
+    settings.adaptive_shadows = true;
+    double adaptive_ms = time_ms(runs, [&]() { render(adaptive, width, height, scene, envmap, settings); });
+    std::cout << "full budget: " << uniform_ms << " ms, adaptive: " << adaptive_ms << " ms ("
+	      << uniform_ms / adaptive_ms << "x), mean abs difference " << mean_abs_difference(uniform, adaptive) << std::endl;
+}
+
+// Hits of the default scene through every acceleration structure against
+// testing its primitives in turn, for the primary rays and for random rays
+// grazing the ground. Flat boxes must not lose rays to rounding.
+template <typename T>
+bool check_accelerated_hits(const char* name, int width, int height) {
+    std::vector<Vec3<T>> origins, directions;
+    const double tan_half_fov = std::tan(70.0 / 2);
+    for (int j = 0;j < height;++j) {
+	for (int i = 0;i < width;++i) {
+	    T x = (2 * (i + 0.5) / width - 1) * tan_half_fov * width / height;
+	    T y = -(2 * (j + 0.5) / height - 1) * tan_half_fov;
+	    origins.push_back(Vec3<T>(0, 0, 0));
+	    directions.push_back(Vec3<T>(x, y, -1).normalize());
+	}
+    }
+    std::mt19937 generator(6);
+    std::uniform_real_distribution<T> uniform(-1, 1);
+    for (int i = 0;i < 1000000;++i) {
+	origins.push_back(Vec3<T>(uniform(generator) * 30, uniform(generator) * 10, uniform(generator) * 30 - 20));
+	directions.push_back(Vec3<T>(uniform(generator), uniform(generator) * T(0.05), uniform(generator)).normalize());
+    }
+
+    Scene<T> loop;
+    make_default_scene(loop);
+    const Accelerator accelerators[] = {Accelerator::BVH, Accelerator::WideBVH, Accelerator::Grid};
+    const char* names[] = {"BVH", "wide BVH", "grid"};
+    for (int a = 0;a < 3;++a) {
+	Scene<T> scene;
+	make_default_scene(scene);
+	scene.accelerator = accelerators[a];
+	scene.build_accelerator();
+	size_t differing = 0;
+	for (size_t i = 0;i < origins.size();++i) {
+	    T t = std::numeric_limits<T>::max(), loop_t = std::numeric_limits<T>::max();
+	    uint32_t hit = scene.intersect_primitives(origins[i], directions[i], t);
+	    uint32_t loop_hit = loop.intersect_primitives(origins[i], directions[i], loop_t);
+	    differing += hit != loop_hit || t != loop_t;
+	}
+	std::cout << name << ", " << names[a] << ": " << differing << " of " << origins.size() << " rays hit differently from the loop" << std::endl;
+	if (differing > 0) {
+	    std::cerr << "the " << names[a] << " lost hits of the default scene" << std::endl;
+	    return false;
+	}
+    }
+    return true;
+}
+
+bool bench_accelerated_hits(int width, int height) {
+    std::cout << "== accelerated hits" << std::endl;
+    return check_accelerated_hits<float>("float", width, height) && check_accelerated_hits<double>("double", width, height);
+}
+
+// Shadow rays of the default scene, with and without testing the last
+// occluder of each light first, lit by point lights and by area lights. The
+// images must be the same.
+bool bench_occluder_cache(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== occluder cache" << std::endl;
+    Scene<float> scenes[2];
+    const char* names[2] = {"point lights", "area lights"};
+    make_default_scene(scenes[0]);
+    make_default_scene(scenes[1]);
+    make_area_lights(scenes[1], 6.0f, 16);
+    for (int s = 0;s < 2;++s) {
+	Scene<float>& scene = scenes[s];
+	scene.build_accelerator();
+
+	RenderSettings settings;
+	Framebuffer<float> uncached, cached;
+	RenderStats stats;
+	settings.occluder_cache = false;
+	double uncached_ms = time_ms(runs, [&]() { render(uncached, width, height, scene, envmap, settings); });
+	settings.occluder_cache = true;
+	double cached_ms = time_ms(runs, [&]() { stats = render(cached, width, height, scene, envmap, settings); });
+	double difference = mean_abs_difference(uncached, cached);
+	std::cout << names[s] << ": " << stats.shadow_rays << " shadow rays, hit rate " << 100 * stats.occluder_cache_hit_rate() << "%, "
+		  << uncached_ms << " ms uncached, " << cached_ms << " ms cached, mean abs difference " << difference << std::endl;
+	if (difference != 0) {
+	    std::cerr << "the occluder cache changed the image" << std::endl;
+	    return false;
+	}
+    }
+    return true;
+}
+
+// The general shading kernel against the kernels of every material class,
+// depth first and breadth first, on the default scene and a forest at half
+// resolution. Lights being points, no random numbers are drawn and the
+// images must be the same.
+bool bench_material_kernels(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== material kernels, " << width / 2 << "x" << height / 2 << std::endl;
+    Scene<float> scenes[2];
+    const char* names[2] = {"default scene", "forest of 200 trees"};
+    make_default_scene(scenes[0]);
+    make_default_scene(scenes[1]);
+    add_forest(scenes[1], 200);
+    for (int s = 0;s < 2;++s) {
+	Scene<float>& scene = scenes[s];
+	scene.build_accelerator();
+	if (!scene.instances.empty()) scene.build_instance_bvh();
+
+	for (bool wavefront : {false, true}) {
+	    RenderSettings settings;
+	    settings.wavefront = wavefront;
+	    Framebuffer<float> general, specialized;
+	    settings.material_kernels = false;
+	    double general_ms = time_ms(runs, [&]() { render(general, width / 2, height / 2, scene, envmap, settings); });
+	    settings.material_kernels = true;
+	    double specialized_ms = time_ms(runs, [&]() { render(specialized, width / 2, height / 2, scene, envmap, settings); });
+	    double difference = mean_abs_difference(general, specialized);
+	    std::cout << names[s] << (wavefront ? ", wavefront: " : ", recursive: ") << general_ms << " ms general, "
+		      << specialized_ms << " ms per class (" << general_ms / specialized_ms << "x), mean abs difference " << difference << std::endl;
+	    if (difference != 0) {
+		std::cerr << "the material kernels changed the image" << std::endl;
+		return false;
+	    }
+	}
+    }
+    return true;
+}
+
+// The default scene baked at compile time, against the same scene built at
+// run time and traversed through its BVH or tested primitive by primitive:
+// primary rays, then whole renders. All three must find the same hits and
+// give the same image.
+template <typename T>
+bool bench_baked_scene(const char* name, const Envmap& envmap, int width, int height, int runs) {
+    Scene<T> scenes[3];
+    const char* names[3] = {"BVH", "loop", "baked"};
+    make_default_scene(scenes[0]);
+    scenes[0].build_accelerator();
+    make_default_scene(scenes[1]);
+    make_baked_scene<DefaultBakedScene>(scenes[2]);
+
+    const int ray_count = width * height;
+    std::vector<Vec3<T>> directions(ray_count);
+    for (int i = 0;i < ray_count;++i) {
+	T x = (2 * (i % width + T(0.5)) / width - 1) * width / height;
+	T y = -(2 * (i / width + T(0.5)) / height - 1);
+	directions[i] = Vec3<T>(x, y, T(-1.4)).normalize();
+    }
+    std::vector<uint32_t> hits[3];
+    std::vector<T> distances[3];
+    Framebuffer<T> images[3];
+    RenderSettings settings;
+    std::cout << name << ":";
+    for (int s = 0;s < 3;++s) {
+	const Scene<T>& scene = scenes[s];
+	hits[s].resize(ray_count);
+	distances[s].resize(ray_count);
+	double intersect_ms = time_ms(runs, [&]() {
+	    #pragma omp parallel for
+	    for (int i = 0;i < ray_count;++i) {
+		T t = std::numeric_limits<T>::max();
+		hits[s][i] = scene.intersect_primitives(Vec3<T>(0, 0, 0), directions[i], t);
+		distances[s][i] = t;
+	    }
+	});
+	double render_ms = time_ms(runs, [&]() { render(images[s], width, height, scene, envmap, settings); });
+	std::cout << " " << names[s] << " " << ray_count / (intersect_ms * 1e3) << " Mrays/s, render " << render_ms << " ms" << (s < 2 ? ";" : "");
+    }
+    std::cout << std::endl;
+    if (hits[0] != hits[1] || distances[0] != distances[1]) {
+	std::cerr << "the BVH found other hits" << std::endl;
+	return false;
+    }
+    if (mean_abs_difference(images[0], images[1]) != 0) {
+	std::cerr << "the BVH changed the image" << std::endl;
+	return false;
+    }
+    if (hits[1] != hits[2] || distances[1] != distances[2]) {
+	std::cerr << "the baked scene found other hits" << std::endl;
+	return false;
+    }
+    if (mean_abs_difference(images[1], images[2]) != 0) {
+	std::cerr << "the baked scene changed the image" << std::endl;
+	return false;
+    }
+    return true;
+}
+
+bool bench_baked_scenes(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== baked scene" << std::endl;
+    return bench_baked_scene<float>("float", envmap, width, height, runs) && bench_baked_scene<double>("double", envmap, width, height, runs);
+}
+
+// Renders with and without the culling of the tiles that only show the
+// envmap: the default scene, its spheres alone, and a forest. The images
+// must be the same.
+bool bench_tile_culling(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== tile culling" << std::endl;
+    Scene<float> scenes[3];
+    const char* names[3] = {"default scene", "spheres alone", "forest of 200 trees"};
+    make_default_scene(scenes[0]);
+    make_default_scene(scenes[1]);
+    scenes[1].rectangles.clear();
+    make_default_scene(scenes[2]);
+    add_forest(scenes[2], 200);
+    for (int s = 0;s < 3;++s) {
+	Scene<float>& scene = scenes[s];
+	scene.build_accelerator();
+	if (!scene.instances.empty()) scene.build_instance_bvh();
+
+	for (bool wavefront : {false, true}) {
+	    RenderSettings settings;
+	    settings.wavefront = wavefront;
+	    Framebuffer<float> traced, culled;
+	    settings.tile_culling = false;
+	    double traced_ms = time_ms(runs, [&]() { render(traced, width, height, scene, envmap, settings); });
+	    settings.tile_culling = true;
+	    RenderStats stats;
+	    double culled_ms = time_ms(runs, [&]() { stats = render(culled, width, height, scene, envmap, settings); });
+	    double difference = mean_abs_difference(traced, culled);
+	    std::cout << names[s] << (wavefront ? ", wavefront: " : ", recursive: ") << 100 * stats.envmap_tile_rate() << "% of tiles culled, "
+		      << traced_ms << " ms traced, " << culled_ms << " ms culled (" << traced_ms / culled_ms << "x), mean abs difference " << difference << std::endl;
+	    if (difference != 0) {
+		std::cerr << "tile culling changed the image" << std::endl;
+		return false;
+	    }
+	}
+    }
+    return true;
+}
+
+// Primary hits found by the rasterization prepass against traced ones. On
+// the default scene, with jittered samples, the image must be the one of
+// testing every primitive in turn. On the default scene and fields of
+// spheres in front of the camera, the primary hits alone, then whole
+// renders, are timed against tracing through the BVH, which must find the
+// same hit and distance at every pixel and give the same image.
+bool bench_raster_prepass(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== raster prepass" << std::endl;
+    {
+	Scene<float> scene;
+	make_default_scene(scene);
+	RenderSettings settings;
+	settings.samples = 2;
+	Framebuffer<float> traced, rasterized;
+	render(traced, width / 2, height / 2, scene, envmap, settings);
+	settings.raster_prepass = true;
+	render(rasterized, width / 2, height / 2, scene, envmap, settings);
+	if (mean_abs_difference(traced, rasterized) != 0) {
+	    std::cerr << "the raster prepass found other primary hits than tracing" << std::endl;
+	    return false;
+	}
+    }
+
+    const double tan_half_fov = std::tan(70.0 / 2);
+    const int tiles_x = (width + render_tile_size - 1) / render_tile_size;
+    const int tiles_y = (height + render_tile_size - 1) / render_tile_size;
+    std::vector<Vec3f> directions((size_t)width * height);
+    for (int j = 0;j < height;++j) {
+	for (int i = 0;i < width;++i) {
+	    float x = (2 * (i + 0.5) / width - 1) * tan_half_fov * width / height;
+	    float y = -(2 * (j + 0.5) / height - 1) * tan_half_fov;
+	    directions[(size_t)j * width + i] = Vec3f(x, y, -1).normalize();
+	}
+    }
+    const int sphere_counts[] = {0, 10000, 100000};
+    for (int count : sphere_counts) {
+	Scene<float> scene;
+	make_default_scene(scene);
+	std::mt19937 generator(5);
+	std::uniform_real_distribution<float> x(-40, 40), y(-3.5f, 30), z(-150, -20);
+	for (int i = 0;i < count;++i) {
+	    scene.spheres.push_back(Sphere<float>(Vec3f(x(generator), y(generator), z(generator)), 0.4f, Material<float>()));
+	}
+	scene.build_accelerator();
+
+	// Primary hits through pixel centers, by tiles in both cases.
+	std::vector<uint32_t> traced_hits((size_t)width * height), raster_hits((size_t)width * height);
+	std::vector<float> traced_depths((size_t)width * height), raster_depths((size_t)width * height);
+	double trace_ms = time_ms(runs, [&]() {
+	    #pragma omp parallel for schedule(dynamic)
+	    for (int tile = 0;tile < tiles_x * tiles_y;++tile) {
+		const int x0 = tile % tiles_x * render_tile_size, y0 = tile / tiles_x * render_tile_size;
+		for (int j = y0;j < std::min(height, y0 + render_tile_size);++j) {
+		    for (int i = x0;i < std::min(width, x0 + render_tile_size);++i) {
+			size_t pixel = (size_t)j * width + i;
+			traced_depths[pixel] = std::numeric_limits<float>::max();
+			traced_hits[pixel] = scene.intersect_primitives(Vec3f(0, 0, 0), directions[pixel], traced_depths[pixel]);
+		    }
+		}
+	    }
+	});
+	double raster_ms = time_ms(runs, [&]() {
+	    frame_arena().reset();
+	    RasterBins bins = bin_primitives(scene, width, height, tan_half_fov, render_tile_size, frame_arena());
+	    #pragma omp parallel for schedule(dynamic)
+	    for (int tile = 0;tile < tiles_x * tiles_y;++tile) {
+		const int x0 = tile % tiles_x * render_tile_size, x1 = std::min(width, x0 + render_tile_size);
+		const int y0 = tile / tiles_x * render_tile_size, y1 = std::min(height, y0 + render_tile_size);
+		Vec3f tile_directions[render_tile_size * render_tile_size];
+		uint32_t primitives[render_tile_size * render_tile_size];
+		float depths[render_tile_size * render_tile_size];
+		for (int j = y0;j < y1;++j) {
+		    for (int i = x0;i < x1;++i) {
+			tile_directions[(j - y0) * (x1 - x0) + i - x0] = directions[(size_t)j * width + i];
+		    }
+		}
+		rasterize_tile(scene, bins, x0, y0, x1, y1, tile_directions, primitives, depths);
+		for (int j = y0;j < y1;++j) {
+		    for (int i = x0;i < x1;++i) {
+			raster_hits[(size_t)j * width + i] = primitives[(j - y0) * (x1 - x0) + i - x0];
+			raster_depths[(size_t)j * width + i] = depths[(j - y0) * (x1 - x0) + i - x0];
+		    }
+		}
+	    }
+	});
+
+	RenderSettings settings;
+	Framebuffer<float> traced, rasterized;
+	double traced_ms = time_ms(runs, [&]() { render(traced, width, height, scene, envmap, settings); });
+	settings.raster_prepass = true;
+	double rasterized_ms = time_ms(runs, [&]() { render(rasterized, width, height, scene, envmap, settings); });
+	size_t hits = 0, differing_hits = 0, differing = 0;
+	for (size_t i = 0;i < (size_t)width * height;++i) {
+	    hits += traced_hits[i] != Scene<float>::no_primitive;
+	    differing_hits += traced_hits[i] != raster_hits[i] || traced_depths[i] != raster_depths[i];
+	    Vec3f a = traced.load(i), b = rasterized.load(i);
+	    differing += a.x != b.x || a.y != b.y || a.z != b.z;
+	}
+	std::cout << "default scene and " << count << " spheres: primary hits " << trace_ms << " ms traced, " << raster_ms << " ms rasterized ("
+		  << trace_ms / raster_ms << "x, " << hits << " hits, " << differing_hits << " differ); render " << traced_ms << " ms traced, "
+		  << rasterized_ms << " ms with the prepass (" << traced_ms / rasterized_ms << "x), " << differing << " pixels differ" << std::endl;
+	if (differing_hits > 0 || differing > 0) {
+	    std::cerr << "the raster prepass found other primary hits than tracing" << std::endl;
+	    return false;
+	}
+    }
+    return true;
+}
+
+// Times exact and fast over count inputs, then finds the largest error of
+// fast divided by its bound, which must not exceed 1.
+template <typename Exact, typename Fast, typename Error>
+bool check_fast_math(const char* name, int count, Exact exact, Fast fast, Error error) {
+    std::vector<float> results(count);
+    double exact_ms = time_ms(3, [&]() { for (int i = 0;i < count;++i) results[i] = exact(i); });
+    double fast_ms = time_ms(3, [&]() { for (int i = 0;i < count;++i) results[i] = fast(i); });
+    double worst = 0;
+    for (int i = 0;i < count;++i) worst = std::max(worst, error(i, results[i]));
+    std::cout << name << ": " << exact_ms * 1e6 / count << " ns exact, " << fast_ms * 1e6 / count
+	      << " ns fast, largest error " << worst << " of the bound" << std::endl;
+    if (!(worst <= 1)) {
+	std::cerr << "fast " << name << " exceeds its error bound" << std::endl;
+	return false;
+    }
+    return true;
+}
+
+// The kernels of fast_math.hpp against the standard functions over a million
+// inputs each, then the default scene under point and area lights rendered
+// in exact and fast math mode.
+bool bench_fast_math(const Envmap& envmap, int width, int height, int runs) {
+    std::cout << "== fast math" << std::endl;
+    const int count = 1000000;
+    std::mt19937 generator(13);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::vector<float> a(count), b(count);
+    auto fill = [&](float a0, float a1, float b0, float b1) {
+	for (int i = 0;i < count;++i) {
+	    a[i] = a0 + (a1 - a0) * uniform(generator);
+	    b[i] = b0 + (b1 - b0) * uniform(generator);
+	}
+    };
+
+    fill(-1, 1, -1, 1);
+    bool within_bounds = check_fast_math("atan2", count,
+	[&](int i) { return std::atan2(a[i], b[i]); },
+	[&](int i) { return fast_atan2(a[i], b[i]); },
+	[&](int i, float r) { return std::fabs(r - std::atan2((double)a[i], (double)b[i])) / 1e-5; });
+    // Logarithms and square roots over 2^-100 to 2^100.
+    fill(-100, 100, 0, 0);
+    for (float& x : a) x = std::exp2(x);
+    within_bounds = check_fast_math("log2", count,
+	[&](int i) { return std::log2(a[i]); },
+	[&](int i) { return fast_log2(a[i]); },
+	[&](int i, float r) { double l = std::log2((double)a[i]); return std::fabs(r - l) / (2e-7 + 2e-7 * std::fabs(l)); }) && within_bounds;
+    within_bounds = check_fast_math("rsqrt", count,
+	[&](int i) { return 1 / std::sqrt(a[i]); },
+	[&](int i) { return fast_rsqrt(a[i]); },
+	[&](int i, float r) { return std::fabs(r * std::sqrt((double)a[i]) - 1) / 3e-7; }) && within_bounds;
+    fill(-125, 127, 0, 0);
+    within_bounds = check_fast_math("exp2", count,
+	[&](int i) { return std::exp2(a[i]); },
+	[&](int i) { return fast_exp2(a[i]); },
+	[&](int i, float r) { return std::fabs(r / std::exp2((double)a[i]) - 1) / 3e-7; }) && within_bounds;
+    // Cosines raised to specular exponents, down to results of 2^-125.
+    fill(0, 1, 1, 1500);
+    within_bounds = check_fast_math("pow", count,
+	[&](int i) { return std::pow(a[i], b[i]); },
+	[&](int i) { return fast_pow(a[i], b[i]); },
+	[&](int i, float r) {
+	    double l = b[i] * std::log2((double)a[i]);
+	    return l < -125 ? 0 : std::fabs(r / std::exp2(l) - 1) / (3e-7 + 2e-7 * std::fabs(l));
+	}) && within_bounds;
+
+    Scene<float> scenes[2];
+    const char* names[2] = {"point lights", "area lights"};
+    make_default_scene(scenes[0]);
+    make_default_scene(scenes[1]);
+    make_area_lights(scenes[1], 6.0f, 16);
+    for (int s = 0;s < 2;++s) {
+	Scene<float>& scene = scenes[s];
+	scene.build_accelerator();
+
+	RenderSettings settings;
+	Framebuffer<float> exact, fast;
+	double exact_ms = time_ms(runs, [&]() { render(exact, width, height, scene, envmap, settings); });
+	settings.fast_math = true;
+	double fast_ms = time_ms(runs, [&]() { render(fast, width, height, scene, envmap, settings); });
+	std::cout << names[s] << ": " << exact_ms << " ms exact, " << fast_ms << " ms fast (" << exact_ms / fast_ms
+		  << "x), mean abs difference " << mean_abs_difference(exact, fast) << std::endl;
+    }
+    return within_bounds;
+}
+
+// Rays traced depth first per pixel or breadth first per tile, through the
+// default scene and a forest, at half resolution. The lights being points,
+// no random numbers are drawn and the images must be the same but for
+// rounding.
+bool bench_wavefront(const Envmap& envmap, int width, int height) {
+    std::cout << "== wavefront, " << width / 2 << "x" << height / 2 << std::endl;
+    Scene<float> scenes[2];
+    const char* names[2] = {"default scene", "forest of 200 trees"};
+    make_default_scene(scenes[0]);
+    make_default_scene(scenes[1]);
+    add_forest(scenes[1], 200);
+    for (int s = 0;s < 2;++s) {
+	Scene<float>& scene = scenes[s];
+	scene.build_accelerator();
+	if (!scene.instances.empty()) scene.build_instance_bvh();
+
+	RenderSettings settings;
+	Framebuffer<float> recursive, wavefront;
+	double recursive_ms = time_ms(1, [&]() { render(recursive, width / 2, height / 2, scene, envmap, settings); });
+	settings.wavefront = true;
+	double wavefront_ms = time_ms(1, [&]() { render(wavefront, width / 2, height / 2, scene, envmap, settings); });
+	double difference = mean_abs_difference(recursive, wavefront);
+	std::cout << names[s] << ": recursive " << recursive_ms << " ms, wavefront " << wavefront_ms << " ms ("
+		  << recursive_ms / wavefront_ms << "x), mean abs difference " << difference << std::endl;
+	if (!(difference <= 1e-6)) {
+	    std::cerr << "the wavefront image differs" << std::endl;
+	    return false;
+	}
+    }
+    return true;
+}
+
+// The default scene lit by lighting rigs of growing size, shading every
+// light, the lights the tree finds in range, or a few lights it draws.
+void bench_many_lights(const Envmap& envmap, int width, int height) {
+    const int light_selection = 4;
+    std::cout << "== light rigs, " << width / 4 << "x" << height / 4 << std::endl;
+    for (int count : {256, 1024, 4096}) {
+	Scene<float> scene;
+	make_default_scene(scene);
+	add_light_rig(scene, count);
+	scene.build_accelerator();
+
+	RenderSettings settings;
+	Framebuffer<float> all, in_range, selected;
+	double all_ms = time_ms(1, [&]() { render(all, width / 4, height / 4, scene, envmap, settings); });
+	scene.build_light_tree();
+	double in_range_ms = time_ms(1, [&]() { render(in_range, width / 4, height / 4, scene, envmap, settings); });
+	settings.light_selection = light_selection;
+	double selected_ms = time_ms(1, [&]() { render(selected, width / 4, height / 4, scene, envmap, settings); });
+	std::cout << scene.lights.size() << " lights: all " << all_ms << " ms, in range " << in_range_ms << " ms, "
+		  << light_selection << " drawn " << selected_ms << " ms; mean abs difference to all: in range "
+		  << mean_abs_difference(in_range, all) << ", drawn " << mean_abs_difference(selected, all) << std::endl;
+    }
+}
+
+// Loads the envmap decoding it and writing the cache, then mapping the
+// cache, which must hold the same pixels and distribution.
+bool bench_envmap_cache(const char* path) {
+    std::cout << "== envmap cache" << std::endl;
+    EnvmapSource source;
+    if (!stat_envmap_source(path, source)) return false;
+    const std::string cache_path = envmap_cache_path(".", source);
+    std::remove(cache_path.c_str());
+
+    Envmap decoded = {}, mapped = {};
+    double decode_ms = time_ms(1, [&]() { load_envmap_cached(path, decoded, "."); });
+    double map_ms = time_ms(1, [&]() { load_envmap_cached(path, mapped, "."); });
+    std::cout << "decoded and cached in " << decode_ms << " ms, mapped in " << map_ms << " ms" << std::endl;
+
+    bool same = mapped.mapping && !decoded.mapping && mapped.mips.size() == decoded.mips.size()
+	&& mapped.distribution.marginal == decoded.distribution.marginal && mapped.distribution.conditional == decoded.distribution.conditional;
+    for (int level = 0;same && level <= (int)decoded.mips.size();++level) {
+	int width, height;
+	const unsigned char* a = envmap_level(decoded, level, width, height);
+	const unsigned char* b = envmap_level(mapped, level, width, height);
+	same = std::memcmp(a, b, (size_t)width * height * decoded.channels * envmap_component_bytes(decoded)) == 0;
+    }
+    free_envmap(decoded);
+    free_envmap(mapped);
+    std::remove(cache_path.c_str());
+    if (!same) {
+	std::cerr << "the cached envmap differs from the decoded one" << std::endl;
+	return false;
+    }
+    return true;
+}
+
+// Lookups through tiles read on first touch, with room for 16 MiB of them,
+// against the same lookups in the whole envmap: random directions, then
+// directions within 35 degrees of the view axis, as seen through a camera.
+bool bench_envmap_tiles(const Envmap& envmap, const char* path) {
+    std::cout << "== envmap tiles" << std::endl;
+    EnvmapSource source;
+    if (!stat_envmap_source(path, source)) return false;
+    const std::string tile_path = envmap_cache_path(".", source, ".tiles");
+    Envmap tiled = {};
+    double write_ms = time_ms(1, [&]() { write_envmap_tiles(tile_path, source, envmap, envmap_tile_size); });
+    if (!open_envmap_tiles(tile_path, source, tiled, 16 << 20)) {
+	std::cerr << "cannot open the envmap tiles" << std::endl;
+	std::remove(tile_path.c_str());
+	return false;
+    }
+    std::cout << tiled.tiles->tile_count << " tiles of " << tiled.tiles->tile_bytes / 1024 << " KiB written in " << write_ms
+	      << " ms, " << tiled.tiles->capacity << " resident" << std::endl;
+
+    const int lookup_count = 1000000;
+    std::mt19937 generator(11);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    std::vector<Vec3f> directions(lookup_count);
+    bool same = true;
+    for (float spread : {1.0f, 0.5f}) {
+	for (auto& direction : directions) {
+	    direction = spread == 1.0f ? Vec3f(uniform(generator), uniform(generator), uniform(generator)).normalize()
+		: Vec3f(uniform(generator) * spread, uniform(generator) * spread, -1).normalize();
+	}
+	for (float footprint : {0.0f, 0.01f}) {
+	    Vec3f whole_sum(0, 0, 0), tiled_sum(0, 0, 0);
+	    double whole_ms = time_ms(1, [&]() {
+		for (const auto& direction : directions) whole_sum = whole_sum + sample_envmap(envmap, direction, footprint);
+	    });
+	    size_t reads = tiled.tiles->reads;
+	    double tiled_ms = time_ms(1, [&]() {
+		for (const auto& direction : directions) tiled_sum = tiled_sum + sample_envmap(tiled, direction, footprint);
+	    });
+	    same = same && whole_sum.x == tiled_sum.x && whole_sum.y == tiled_sum.y && whole_sum.z == tiled_sum.z;
+	    std::cout << (spread == 1.0f ? "random" : "view") << " directions, footprint " << footprint << " rad: "
+		      << lookup_count / (whole_ms * 1e3) << " Mlookups/s whole, " << lookup_count / (tiled_ms * 1e3) << " tiled, "
+		      << tiled.tiles->reads - reads << " tiles read" << std::endl;
+	}
+    }
+    free_envmap(tiled);
+    std::remove(tile_path.c_str());
+    if (!same) {
+	std::cerr << "lookups through the envmap tiles differ from the whole envmap" << std::endl;
+	return false;
+    }
+    return true;
+}
+
+// Lookups in random directions, filtered bilinearly on the full image or
+// trilinearly over the footprint of wide cones, down the pyramid.
+void bench_envmap_sampling(const Envmap& envmap) {
+    const int lookup_count = 1000000;
+    std::cout << "== envmap sampling, " << envmap.width << "x" << envmap.height << ", " << envmap.mips.size() << " mip levels" << std::endl;
+    std::mt19937 generator(5);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    std::vector<Vec3f> directions(lookup_count);
+    for (auto& direction : directions) {
+	direction = Vec3f(uniform(generator), uniform(generator), uniform(generator)).normalize();
+    }
+
+    for (float footprint : {0.0f, 0.01f, 0.1f}) {
+	Vec3f sum(0, 0, 0);
+	double ms = time_ms(1, [&]() {
+	    for (const auto& direction : directions) sum = sum + sample_envmap(envmap, direction, footprint);
+	});
+	std::cout << "footprint " << footprint << " rad: " << lookup_count / (ms * 1e3) << " Mlookups/s, mean " << sum.x / lookup_count << std::endl;
+    }
+}
+
+// HDR copy of a level of an 8-bit envmap, linearized, with a sun a thousand
+// times brighter than the sky.
+Envmap make_sun_envmap(const Envmap& envmap, int level) {
+    int width, height;
+    const unsigned char* pixels = envmap_level(envmap, level, width, height);
+    float* radiance = (float*)std::malloc((size_t)width * height * 3 * sizeof(float));
+    for (int y = 0;y < height;++y) {
+	for (int x = 0;x < width;++x) {
+	    float dx = x - width * 0.6f, dy = y - height * 0.2f;
+	    bool sun = dx * dx + dy * dy < width * width / 10000.0f;
+	    for (int c = 0;c < 3;++c) {
+		size_t i = ((size_t)y * width + x) * 3 + c;
+		radiance[i] = sun ? 1000.0f : std::pow(pixels[(size_t)(y * width + x) * envmap.channels + c] / 255.0f, 2.2f);
+	    }
+	}
+    }
+    Envmap sun = make_envmap(width, height, 3, (unsigned char*)radiance);
+    sun.hdr = true;
+    build_envmap_mips(sun);
+    build_envmap_distribution(sun);
+    return sun;
+}
+
+// Error of the diffuse light from the envmap under an upward normal,
+// estimated from 16 directions drawn uniformly on the sphere or following the
+// distribution of the envmap, against an estimate from a million directions.
+void bench_environment_sampling(const Envmap& envmap, const char* name) {
+    const int sample_count = 16;
+    const int estimate_count = 10000;
+    std::cout << "== environment sampling, " << name << ", " << sample_count << " directions" << std::endl;
+    std::mt19937 generator(6);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    const Vec3<double> N(0, 1, 0);
+    auto importance = [&]() {
+	double pdf;
+	Vec3<double> direction = sample_envmap_direction(envmap, uniform(generator), uniform(generator), pdf);
+	return sample_envmap(envmap, direction).y * std::max(0.0, direction * N) / (M_PI * pdf);
+    };
+    auto sphere = [&]() {
+	double z = 2 * uniform(generator) - 1, phi = 2 * M_PI * uniform(generator), r = std::sqrt(1 - z * z);
+	Vec3<double> direction(r * std::cos(phi), z, r * std::sin(phi));
+	return sample_envmap(envmap, direction).y * std::max(0.0, direction * N) * 4;
+    };
+
+    double reference = 0;
+    for (int i = 0;i < 1000000;++i) reference += importance() / 1000000;
+    for (int strategy = 0;strategy < 2;++strategy) {
+	double squared_error = 0;
+	for (int i = 0;i < estimate_count;++i) {
+	    double estimate = 0;
+	    for (int k = 0;k < sample_count;++k) estimate += (strategy == 0 ? sphere() : importance()) / sample_count;
+	    squared_error += (estimate - reference) * (estimate - reference) / estimate_count;
+	}
+	std::cout << (strategy == 0 ? "uniform   " : "importance") << ": relative RMS error " << std::sqrt(squared_error) / reference << std::endl;
+    }
+}
+
+// Renders the default scene twice and counts the heap allocations of the
+// second render, which must not have any once the arenas have grown.
+bool bench_render_allocations(const Envmap& envmap, int width, int height) {
+    std::cout << "== render allocations" << std::endl;
+    Scene<float> scene;
+    make_default_scene(scene);
+    scene.build_accelerator();
+
+    Framebuffer<float> framebuffer;
+    render(framebuffer, width, height, scene, envmap);
+    allocation_count = 0;
+    count_allocations = true;
+    render(framebuffer, width, height, scene, envmap);
+    count_allocations = false;
+
+    std::cout << "allocations during render: " << allocation_count << ", thread arena "
+	      << thread_arena().capacity() / 1024 << " KiB" << std::endl;
+    if (allocation_count != 0) {
+	std::cerr << "render allocated from the heap" << std::endl;
+	return false;
+    }
+    return true;
+}
+
+std::vector<Sphere<float>> random_spheres(int count, float extent, float radius, uint32_t seed) {
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> position(-extent, extent);
+    std::vector<Sphere<float>> spheres;
+    spheres.reserve(count);
+    for (int i = 0;i < count;++i) {
+	spheres.push_back(Sphere<float>(Vec3f(position(generator), position(generator), position(generator)), radius, Material<float>()));
+    }
+    return spheres;
+}
+
+void bench_bvh_build() {
+    const int sphere_count = 1000000;
+    std::cout << "== BVH build, " << sphere_count << " spheres, " << omp_get_max_threads() << " threads" << std::endl;
+
+    Scene<float> scene;
+    scene.spheres = random_spheres(sphere_count, 100, 0.5f, 2);
+    double ms = time_ms(1, [&]() { scene.build_accelerator(); });
+    std::cout << "binned SAH: " << ms << " ms, " << scene.primitive_bvh.bvh.nodes.size() << " nodes, "
+	      << "SAH cost " << scene.primitive_bvh.sah_cost() << std::endl;
+}
+
+// Random rays through a particle dump of equal spheres evenly filling a box,
+// traced with every acceleration structure over the same spheres.
+void bench_traversal() {
+    const int sphere_count = 1000000;
+    const int ray_count = 1000000;
+    std::cout << "== traversal, " << sphere_count << " spheres, " << ray_count << " rays" << std::endl;
+
+    Scene<float> scene;
+    scene.spheres = random_spheres(sphere_count, 100, 0.5f, 3);
+    scene.accelerator = Accelerator::WideBVH;
+    double bvh_ms = time_ms(1, [&]() { scene.build_accelerator(); });
+    scene.accelerator = Accelerator::Grid;
+    double grid_ms = time_ms(1, [&]() { scene.build_accelerator(); });
+    std::cout << "build: BVH and wide BVH " << bvh_ms << " ms, grid " << grid_ms << " ms ("
+	      << scene.primitive_grid.resolution[0] << "x" << scene.primitive_grid.resolution[1] << "x" << scene.primitive_grid.resolution[2] << " cells)" << std::endl;
+
+    Scene<float> selected;
+    selected.spheres = scene.spheres;
+    selected.accelerator = Accelerator::Auto;
+    selected.build_accelerator();
+    std::cout << "auto selection: " << (selected.accelerator == Accelerator::Grid ? "grid" : "BVH") << std::endl;
+
+    std::mt19937 generator(4);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    std::vector<Vec3f> origins(ray_count), directions(ray_count);
+    for (int i = 0;i < ray_count;++i) {
+	origins[i] = Vec3f(uniform(generator), uniform(generator), uniform(generator)) * 150.0f;
+	directions[i] = (Vec3f(uniform(generator), uniform(generator), uniform(generator)) * 50.0f - origins[i]).normalize();
+    }
+
+    const Accelerator accelerators[] = {Accelerator::BVH, Accelerator::WideBVH, Accelerator::Grid};
+    const char* names[] = {"binary BVH", "wide BVH  ", "grid      "};
+    const size_t bytes[] = {scene.primitive_bvh.bvh.memory_bytes(), scene.wide_primitive_bvh.memory_bytes(), scene.primitive_grid.memory_bytes()};
+    for (int a = 0;a < 3;++a) {
+	scene.accelerator = accelerators[a];
+	size_t hits = 0;
+	double ms = time_ms(1, [&]() {
+	    hits = 0;
+	    #pragma omp parallel for reduction(+:hits)
+	    for (int i = 0;i < ray_count;++i) {
+		float t = std::numeric_limits<float>::max();
+		hits += scene.intersect_primitives(origins[i], directions[i], t) != Scene<float>::no_primitive;
+	    }
+	});
+	std::cout << names[a] << ": " << (double)bytes[a] / sphere_count << " bytes/sphere, "
+		  << ray_count / (ms * 1e3) << " Mrays/s, " << hits << " hits" << std::endl;
+    }
+}
+
+// Random spheres in a box, a few of them moving every frame. Compares keeping
+// the BVH up to date by refitting against rebuilding it every frame.
+void bench_sphere_motion() {
+    const int sphere_count = 100000;
+    const int moving = 1000;
+    const int frames = 50;
+    std::cout << "== sphere BVH update, " << sphere_count << " spheres, " << moving << " moving, " << frames << " frames" << std::endl;
+
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> step(-5, 5);
+    std::uniform_int_distribution<uint32_t> pick(0, sphere_count - 1);
+    std::vector<std::vector<SphereTransform<float>>> motion(frames);
+    for (auto& frame : motion) {
+	for (int i = 0;i < moving;++i) {
+	    frame.push_back({pick(generator), Transform<float>::translation(Vec3f(step(generator), step(generator), step(generator)))});
+	}
+    }
+
+    Scene<float> refitted, rebuilt;
+    refitted.spheres = random_spheres(sphere_count, 100, 0.5f, 1);
+    rebuilt.spheres = refitted.spheres;
+    refitted.build_accelerator();
+    rebuilt.build_accelerator();
+
+    double refit_ms = time_ms(1, [&]() {
+	for (const auto& frame : motion) refitted.move_spheres(frame);
+    });
+    double rebuild_ms = time_ms(1, [&]() {
+	for (const auto& frame : motion) {
+	    for (const auto& m : frame) {
+		Sphere<float>& sphere = rebuilt.spheres[m.sphere];
+		sphere.center = m.transform.transform_point(sphere.center);
+	    }
+	    rebuilt.build_accelerator();
+	}
+    });
+
+    std::cout << "refit:   " << refit_ms / frames << " ms/frame, " << refitted.primitive_bvh.rebuild_count - 1 << " rebuilds, "
+	      << "SAH cost " << refitted.primitive_bvh.sah_cost() << std::endl;
+    std::cout << "rebuild: " << rebuild_ms / frames << " ms/frame, SAH cost " << rebuilt.primitive_bvh.sah_cost() << std::endl;
+}
+
+int main(int argc, char** argv) {
+    const int width = argc > 1 ? atoi(argv[1]) : 960;
+    const int height = argc > 2 ? atoi(argv[2]) : 540;
+    const int runs = argc > 3 ? atoi(argv[3]) : 3;
+
+    Envmap envmap = {};
+    if (!load_envmap("../resources/envmap.jpg", envmap)) {
+      return -1;
+    }
+
+    std::cout << width << "x" << height << ", best of " << runs << ", "
+	      << omp_get_max_threads() << " threads" << std::endl;
+
+    bench_precisions(envmap, width, height, runs);
+    bench_framebuffer_formats(envmap, width, height, runs);
+    bench_soft_shadows(envmap, width, height, runs);
+    bench_many_lights(envmap, width, height);
+    bench_envmap_sampling(envmap);
+    bench_environment_sampling(envmap, "8-bit envmap");
+    Envmap sun = make_sun_envmap(envmap, 3);
+    bench_environment_sampling(sun, "HDR envmap with a sun");
+    free_envmap(sun);
+    // Checks, stopping at the first that fails.
+    const bool passed = bench_envmap_cache("../resources/envmap.jpg")
+	&& bench_envmap_tiles(envmap, "../resources/envmap.jpg")
+	&& bench_accelerated_hits(width, height)
+	&& bench_occluder_cache(envmap, width, height, runs)
+	&& bench_wavefront(envmap, width, height)
+	&& bench_fast_math(envmap, width, height, runs)
+	&& bench_material_kernels(envmap, width, height, runs)
+	&& bench_baked_scenes(envmap, width, height, runs)
+	&& bench_tile_culling(envmap, width, height, runs)
+	&& bench_raster_prepass(envmap, width, height, runs)
+	&& bench_sample_reproducibility(envmap, width, height)
+	&& bench_render_allocations(envmap, width, height);
+    if (!passed) {
+	free_envmap(envmap);
+	return -1;
+    }
+    bench_bvh_build();
+    bench_traversal();
+    bench_sphere_motion();
+
+    free_envmap(envmap);
+    return 0;
+}
@@ -0,0 +1,556 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "geometry.hpp"
+
+// Bound on the relative error of n floating point operations in precision
+// T (Pharr et al., Physically Based Rendering, 3.9.1).
+template <typename T>
+constexpr T error_gamma(int n) {
+    return n * (std::numeric_limits<T>::epsilon() / 2) / (1 - n * (std::numeric_limits<T>::epsilon() / 2));
+}
+
+template <typename T>
+struct AABB {
+    AABB() : min(std::numeric_limits<T>::max(), std::numeric_limits<T>::max(), std::numeric_limits<T>::max()),
+	     max(-std::numeric_limits<T>::max(), -std::numeric_limits<T>::max(), -std::numeric_limits<T>::max()) {}
+    AABB(const Vec3<T>& min, const Vec3<T>& max) : min(min), max(max) {}
+
+    Vec3<T> min;
+    Vec3<T> max;
+
+    void extend(const Vec3<T>& point) {
+	min = component_min(min, point);
+	max = component_max(max, point);
+    }
+
+    void extend(const AABB& box) {
+	min = component_min(min, box.min);
+	max = component_max(max, box.max);
+    }
+
+    bool empty() const {
+	return min.x > max.x;
+    }
+
+    Vec3<T> center() const {
+	return (min + max) * T(0.5);
+    }
+
+    T surface_area() const {
+	if (empty()) return 0;
+	Vec3<T> e = max - min;
+	return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    // Slab test restricted to [0, t_max]. t_entry receives the distance at
+    // which the ray enters the box. The exit distance is widened by the
+    // rounding error of its computation (Ize 2013), lest rays grazing a flat
+    // box miss it.
+    bool ray_intersect(const Vec3<T>& origin, const Vec3<T>& inv_direction, T t_max, T& t_entry) const {
+	Vec3<T> t0 = component_mul(min - origin, inv_direction);
+	Vec3<T> t1 = component_mul(max - origin, inv_direction);
+	Vec3<T> t_near = component_min(t0, t1);
+	Vec3<T> t_far = component_max(t0, t1);
+	t_entry = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, T(0)));
+	T t_exit = std::min(std::min(t_far.x, t_far.y), t_far.z) * (1 + 2 * error_gamma<T>(3));
+	t_exit = std::min(t_exit, t_max);
+	return t_entry <= t_exit;
+    }
+};
+
+// Pyramid of the rays from an apex through a convex quadrilateral, bounded
+// by its four side planes. Box tests are conservative: boxes outside the
+// pyramid but straddling two of its planes pass.
+template <typename T>
+struct Frustum {
+    Vec3<T> apex;
+    // Directions of the edge rays, in order around the quadrilateral.
+    Vec3<T> corners[4];
+    // Inward normals of the side planes, which all go through the apex.
+    Vec3<T> normals[4];
+
+    Frustum(const Vec3<T>& apex, const Vec3<T> (&directions)[4]) : apex(apex) {
+	Vec3<T> center;
+	for (int k = 0;k < 4;++k) {
+	    corners[k] = directions[k];
+	    center = center + directions[k];
+	}
+	for (int k = 0;k < 4;++k) {
+	    normals[k] = cross(corners[k], corners[(k + 1) % 4]);
+	    if (normals[k] * center < 0) normals[k] = -normals[k];
+	}
+    }
+
+    bool overlaps(const AABB<T>& box) const {
+	for (const Vec3<T>& n : normals) {
+	    // Corner of the box furthest inside the plane.
+	    Vec3<T> p(n.x > 0 ? box.max.x : box.min.x, n.y > 0 ? box.max.y : box.min.y, n.z > 0 ? box.max.z : box.min.z);
+	    if ((p - apex) * n < 0) return false;
+	}
+	return true;
+    }
+
+    // The rays crossing a plane in front of the apex form a half-space of
+    // directions, which the pyramid reaches if one of its corners does.
+    bool crosses_plane(const Vec3<T>& point, const Vec3<T>& normal) const {
+	T side = (point - apex) * normal;
+	if (side == 0) return true;
+	for (const Vec3<T>& d : corners) {
+	    if ((d * normal) * side > 0) return true;
+	}
+	return false;
+    }
+};
+
+template <typename T>
+struct BVHNode {
+    AABB<T> bounds;
+    // Inner nodes: index of the left child, the right child follows it.
+    // Leaves: offset of the first primitive in BVH::indices.
+    uint32_t first;
+    // Number of primitives of a leaf, 0 for inner nodes.
+    uint32_t count;
+
+    bool is_leaf() const {
+	return count != 0;
+    }
+};
+
+// Binary bounding volume hierarchy over an arbitrary set of primitives, only
+// known through their bounding boxes. Children are always stored after their
+// parent.
+template <typename T>
+struct BVH {
+    static const int bin_count = 16;
+    static const uint32_t max_leaf_size = 8;
+    // Past this depth splits fall back to the object median, which keeps the
+    // tree depth within the traversal stack.
+    static const int max_sah_depth = 32;
+    static const int stack_size = 64;
+
+    std::vector<BVHNode<T>> nodes;
+    // Primitive indices, referenced by the leaves.
+    std::vector<uint32_t> indices;
+
+    // Binned SAH build, parallelized with OpenMP tasks over subtrees and
+    // chunked binning for the nodes with many primitives.
+    void build(const std::vector<AABB<T>>& primitive_bounds) {
+	const uint32_t count = (uint32_t)primitive_bounds.size();
+	nodes.clear();
+	indices.resize(count);
+	if (count == 0) return;
+
+	std::vector<Vec3<T>> centroids(count);
+	#pragma omp parallel for if (count >= parallel_threshold)
+	for (uint32_t i = 0;i < count;++i) {
+	    indices[i] = i;
+	    centroids[i] = primitive_bounds[i].center();
+	}
+
+	nodes.resize(2 * count - 1);
+	std::atomic<uint32_t> node_count(1);
+	#pragma omp parallel if (count >= parallel_threshold)
+	#pragma omp single
+	subdivide(0, 0, count, 0, primitive_bounds, centroids, node_count);
+	nodes.resize(node_count);
+	nodes.shrink_to_fit();
+    }
+
+    // Calls intersect(primitive, t_max) for every primitive whose leaf the ray
+    // reaches, roughly front to back. intersect returns true on a hit and
+    // shrinks t_max to the hit distance.
+    template <typename F>
+    bool traverse(const Vec3<T>& origin, const Vec3<T>& direction, T& t_max, F&& intersect) const {
+	if (nodes.empty()) return false;
+
+	Vec3<T> inv_direction(T(1) / direction.x, T(1) / direction.y, T(1) / direction.z);
+	T t_entry;
+	if (!nodes[0].bounds.ray_intersect(origin, inv_direction, t_max, t_entry)) return false;
+
+	uint32_t stack[stack_size];
+	int stack_top = 0;
+	uint32_t node_index = 0;
+	bool hit = false;
+	while (true) {
+	    const BVHNode<T>& node = nodes[node_index];
+	    if (node.is_leaf()) {
+		for (uint32_t i = node.first;i < node.first + node.count;++i) {
+		    hit |= intersect(indices[i], t_max);
+		}
+		if (stack_top == 0) break;
+		node_index = stack[--stack_top];
+		continue;
+	    }
+
+	    T t_left, t_right;
+	    bool hit_left = nodes[node.first].bounds.ray_intersect(origin, inv_direction, t_max, t_left);
+	    bool hit_right = nodes[node.first + 1].bounds.ray_intersect(origin, inv_direction, t_max, t_right);
+	    if (hit_left && hit_right) {
+		bool left_first = t_left <= t_right;
+		stack[stack_top++] = left_first ? node.first + 1 : node.first;
+		node_index = left_first ? node.first : node.first + 1;
+	    } else if (hit_left) {
+		node_index = node.first;
+	    } else if (hit_right) {
+		node_index = node.first + 1;
+	    } else {
+		if (stack_top == 0) break;
+		node_index = stack[--stack_top];
+	    }
+	}
+	return hit;
+    }
+
+    // True if test() accepts the bounds of a leaf reached through inner
+    // nodes whose bounds it accepts.
+    template <typename F>
+    bool any_leaf(F&& test) const {
+	if (nodes.empty() || !test(nodes[0].bounds)) return false;
+
+	uint32_t stack[stack_size];
+	int stack_top = 0;
+	uint32_t node_index = 0;
+	while (true) {
+	    const BVHNode<T>& node = nodes[node_index];
+	    if (node.is_leaf()) return true;
+
+	    bool left = test(nodes[node.first].bounds);
+	    bool right = test(nodes[node.first + 1].bounds);
+	    if (left && right) {
+		stack[stack_top++] = node.first + 1;
+		node_index = node.first;
+	    } else if (left) {
+		node_index = node.first;
+	    } else if (right) {
+		node_index = node.first + 1;
+	    } else {
+		if (stack_top == 0) return false;
+		node_index = stack[--stack_top];
+	    }
+	}
+    }
+
+    // Contribution of a node to the SAH cost, before normalization by the
+    // root area.
+    static T node_cost(const BVHNode<T>& node) {
+	return node.bounds.surface_area() * (node.is_leaf() ? node.count : 1);
+    }
+
+    // Expected cost of tracing a random ray through the tree, in units of
+    // box or primitive tests. Lower is better.
+    T sah_cost() const {
+	if (nodes.empty()) return 0;
+	T cost = 0;
+	for (const auto& node : nodes) {
+	    cost += node_cost(node);
+	}
+	return cost / nodes[0].bounds.surface_area();
+    }
+
+    size_t memory_bytes() const {
+	return nodes.capacity() * sizeof(BVHNode<T>) + indices.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    // Subtrees with fewer primitives than this are built by a single task,
+    // and nodes with more are binned by several tasks in parallel.
+    static const uint32_t task_threshold = 4096;
+    static const uint32_t parallel_threshold = 65536;
+    static const uint32_t chunk_count = 64;
+
+    struct Bin {
+	AABB<T> bounds;
+	uint32_t count = 0;
+    };
+
+    struct Bins {
+	Bin axes[3][bin_count];
+    };
+
+    struct RangeBounds {
+	AABB<T> bounds;
+	AABB<T> centroid_bounds;
+    };
+
+    // Runs f(chunk_begin, chunk_end, chunk) over [begin, end), split into
+    // chunk_count tasks.
+    template <typename F>
+    static void for_chunks(uint32_t begin, uint32_t end, F&& f) {
+	const uint32_t count = end - begin;
+	const uint32_t chunk_size = (count + chunk_count - 1) / chunk_count;
+	#pragma omp taskloop grainsize(1)
+	for (uint32_t chunk = 0;chunk < chunk_count;++chunk) {
+	    uint32_t chunk_begin = begin + chunk * chunk_size;
+	    f(chunk_begin, std::min(end, chunk_begin + chunk_size), chunk);
+	}
+    }
+
+    RangeBounds range_bounds(uint32_t begin, uint32_t end, const std::vector<AABB<T>>& primitive_bounds,
+			     const std::vector<Vec3<T>>& centroids) const {
+	auto accumulate = [&](uint32_t chunk_begin, uint32_t chunk_end, RangeBounds& result) {
+	    for (uint32_t i = chunk_begin;i < chunk_end;++i) {
+		result.bounds.extend(primitive_bounds[indices[i]]);
+		result.centroid_bounds.extend(centroids[indices[i]]);
+	    }
+	};
+	// Most nodes are too small to be split in parallel, and are bounded
+	// without any per-chunk storage.
+	RangeBounds result;
+	if (end - begin < parallel_threshold) {
+	    accumulate(begin, end, result);
+	    return result;
+	}
+
+	std::vector<RangeBounds> chunks(chunk_count);
+	for_chunks(begin, end, [&](uint32_t chunk_begin, uint32_t chunk_end, uint32_t chunk) {
+	    accumulate(chunk_begin, chunk_end, chunks[chunk]);
+	});
+	for (const auto& chunk : chunks) {
+	    result.bounds.extend(chunk.bounds);
+	    result.centroid_bounds.extend(chunk.centroid_bounds);
+	}
+	return result;
+    }
+
+    static int bin_index(const Vec3<T>& centroid, int axis, const Vec3<T>& min, const Vec3<T>& scale) {
+	return std::min(bin_count - 1, (int)((centroid[axis] - min[axis]) * scale[axis]));
+    }
+
+    // Bins the primitives of [begin, end) along the three axes at once. Like
+    // range_bounds(), only large nodes use per-chunk bins.
+    Bins bin_range(uint32_t begin, uint32_t end, const Vec3<T>& min, const Vec3<T>& scale,
+		   const std::vector<AABB<T>>& primitive_bounds, const std::vector<Vec3<T>>& centroids) const {
+	auto accumulate = [&](uint32_t chunk_begin, uint32_t chunk_end, Bins& bins) {
+	    for (uint32_t i = chunk_begin;i < chunk_end;++i) {
+		const uint32_t primitive = indices[i];
+		for (int axis = 0;axis < 3;++axis) {
+		    Bin& bin = bins.axes[axis][bin_index(centroids[primitive], axis, min, scale)];
+		    bin.count++;
+		    bin.bounds.extend(primitive_bounds[primitive]);
+		}
+	    }
+	};
+	Bins result;
+	if (end - begin < parallel_threshold) {
+	    accumulate(begin, end, result);
+	    return result;
+	}
+
+	std::vector<Bins> chunks(chunk_count);
+	for_chunks(begin, end, [&](uint32_t chunk_begin, uint32_t chunk_end, uint32_t chunk) {
+	    accumulate(chunk_begin, chunk_end, chunks[chunk]);
+	});
+	for (const auto& chunk : chunks) {
+	    for (int axis = 0;axis < 3;++axis) {
+		for (int b = 0;b < bin_count;++b) {
+		    result.axes[axis][b].count += chunk.axes[axis][b].count;
+		    result.axes[axis][b].bounds.extend(chunk.axes[axis][b].bounds);
+		}
+	    }
+	}
+	return result;
+    }
+
+    void make_leaf(BVHNode<T>& node, uint32_t begin, uint32_t end) {
+	node.first = begin;
+	node.count = end - begin;
+    }
+
+    void subdivide(uint32_t node_index, uint32_t begin, uint32_t end, int depth,
+		   const std::vector<AABB<T>>& primitive_bounds, const std::vector<Vec3<T>>& centroids,
+		   std::atomic<uint32_t>& node_count) {
+	BVHNode<T>& node = nodes[node_index];
+	RangeBounds range = range_bounds(begin, end, primitive_bounds, centroids);
+	const AABB<T>& centroid_bounds = range.centroid_bounds;
+	node.bounds = range.bounds;
+
+	const uint32_t count = end - begin;
+	if (count <= 2) {
+	    make_leaf(node, begin, end);
+	    return;
+	}
+
+	Vec3<T> extent = centroid_bounds.max - centroid_bounds.min;
+	Vec3<T> scale;
+	for (int axis = 0;axis < 3;++axis) {
+	    scale[axis] = extent[axis] > 0 ? bin_count / extent[axis] : T(0);
+	}
+
+	int best_axis = -1;
+	int best_bin = 0;
+	T best_cost = std::numeric_limits<T>::max();
+	if (depth < max_sah_depth) {
+	    Bins bins = bin_range(begin, end, centroid_bounds.min, scale, primitive_bounds, centroids);
+	    for (int axis = 0;axis < 3;++axis) {
+		if (extent[axis] <= 0) continue;
+
+		T left_cost[bin_count - 1];
+		AABB<T> left_bounds;
+		uint32_t left_count = 0;
+		for (int b = 0;b < bin_count - 1;++b) {
+		    left_bounds.extend(bins.axes[axis][b].bounds);
+		    left_count += bins.axes[axis][b].count;
+		    left_cost[b] = left_bounds.surface_area() * left_count;
+		}
+
+		AABB<T> right_bounds;
+		uint32_t right_count = 0;
+		for (int b = bin_count - 1;b > 0;--b) {
+		    right_bounds.extend(bins.axes[axis][b].bounds);
+		    right_count += bins.axes[axis][b].count;
+		    T cost = left_cost[b - 1] + right_bounds.surface_area() * right_count;
+		    if (cost < best_cost) {
+			best_cost = cost;
+			best_axis = axis;
+			best_bin = b - 1;
+		    }
+		}
+	    }
+	}
+
+	// Traversal and intersection costs are taken as equal.
+	T area = node.bounds.surface_area();
+	T leaf_cost = area * count;
+	T split_cost = area + best_cost;
+	if (best_axis == -1 || split_cost >= leaf_cost) {
+	    if (count <= max_leaf_size) {
+		make_leaf(node, begin, end);
+		return;
+	    }
+	}
+
+	uint32_t middle = begin;
+	if (best_axis != -1) {
+	    middle = (uint32_t)(std::partition(indices.begin() + begin, indices.begin() + end, [&](uint32_t i) {
+		return bin_index(centroids[i], best_axis, centroid_bounds.min, scale) <= best_bin;
+	    }) - indices.begin());
+	}
+	if (middle == begin || middle == end) {
+	    // Object median along the widest centroid axis.
+	    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	    middle = begin + count / 2;
+	    std::nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end, [&](uint32_t a, uint32_t b) {
+		return centroids[a][axis] < centroids[b][axis];
+	    });
+	}
+
+	uint32_t left = node_count.fetch_add(2);
+	node.first = left;
+	node.count = 0;
+	if (count >= task_threshold) {
+	    #pragma omp task shared(primitive_bounds, centroids, node_count)
+	    subdivide(left, begin, middle, depth + 1, primitive_bounds, centroids, node_count);
+	} else {
+	    subdivide(left, begin, middle, depth + 1, primitive_bounds, centroids, node_count);
+	}
+	subdivide(left + 1, middle, end, depth + 1, primitive_bounds, centroids, node_count);
+    }
+};
+
+// BVH whose primitives move over time. Moved primitives only refit the boxes
+// on their path to the root, and the tree is rebuilt once refitting has
+// degraded its SAH cost past rebuild_threshold times the cost it had when it
+// was built.
+template <typename T>
+struct DynamicBVH {
+    BVH<T> bvh;
+    // Parent of every node, the root is its own parent.
+    std::vector<uint32_t> parents;
+    // Leaf holding every primitive.
+    std::vector<uint32_t> primitive_leaves;
+    T rebuild_threshold = 1.3;
+    // Unnormalized SAH cost, kept up to date while refitting.
+    T cost_sum = 0;
+    T built_cost = 0;
+    size_t rebuild_count = 0;
+
+    bool empty() const {
+	return bvh.nodes.empty();
+    }
+
+    T sah_cost() const {
+	return empty() ? 0 : cost_sum / bvh.nodes[0].bounds.surface_area();
+    }
+
+    void build(const std::vector<AABB<T>>& primitive_bounds) {
+	bvh.build(primitive_bounds);
+	++rebuild_count;
+
+	parents.resize(bvh.nodes.size());
+	primitive_leaves.resize(primitive_bounds.size());
+	cost_sum = 0;
+	if (!empty()) parents[0] = 0;
+	for (uint32_t i = 0;i < bvh.nodes.size();++i) {
+	    const BVHNode<T>& node = bvh.nodes[i];
+	    cost_sum += BVH<T>::node_cost(node);
+	    if (node.is_leaf()) {
+		for (uint32_t j = node.first;j < node.first + node.count;++j) {
+		    primitive_leaves[bvh.indices[j]] = i;
+		}
+	    } else {
+		parents[node.first] = i;
+		parents[node.first + 1] = i;
+	    }
+	}
+	built_cost = sah_cost();
+    }
+
+    // changed lists the primitives that moved since the last update, and
+    // primitive_bounds(i) returns the current bounds of primitive i. Returns
+    // true if the tree had to be rebuilt.
+    template <typename F>
+    bool update(const std::vector<uint32_t>& changed, F&& primitive_bounds) {
+	for (uint32_t primitive : changed) {
+	    uint32_t node_index = primitive_leaves[primitive];
+	    while (true) {
+		BVHNode<T>& node = bvh.nodes[node_index];
+		AABB<T> bounds;
+		if (node.is_leaf()) {
+		    for (uint32_t i = node.first;i < node.first + node.count;++i) {
+			bounds.extend(primitive_bounds(bvh.indices[i]));
+		    }
+		} else {
+		    bounds.extend(bvh.nodes[node.first].bounds);
+		    bounds.extend(bvh.nodes[node.first + 1].bounds);
+		}
+
+		if (same_bounds(bounds, node.bounds)) break;
+		cost_sum -= BVH<T>::node_cost(node);
+		node.bounds = bounds;
+		cost_sum += BVH<T>::node_cost(node);
+
+		if (node_index == 0) break;
+		node_index = parents[node_index];
+	    }
+	}
+
+	if (sah_cost() > rebuild_threshold * built_cost) {
+	    std::vector<AABB<T>> all_bounds(primitive_leaves.size());
+	    for (uint32_t i = 0;i < all_bounds.size();++i) {
+		all_bounds[i] = primitive_bounds(i);
+	    }
+	    build(all_bounds);
+	    return true;
+	}
+	return false;
+    }
+
+    size_t memory_bytes() const {
+	return bvh.memory_bytes() + (parents.capacity() + primitive_leaves.capacity()) * sizeof(uint32_t);
+    }
+
+private:
+    static bool same_bounds(const AABB<T>& a, const AABB<T>& b) {
+	return a.min.x == b.min.x && a.min.y == b.min.y && a.min.z == b.min.z
+	    && a.max.x == b.max.x && a.max.y == b.max.y && a.max.z == b.max.z;
+    }
+};
+
+#endif
@@ -0,0 +1,493 @@
+#ifndef ENVMAP_HPP
+#define ENVMAP_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "stb_image.h"
+
+#include "geometry.hpp"
+#include "fast_math.hpp"
+
+// Level of the mip pyramid of an envmap, half the size of the level above.
+struct EnvmapLevel {
+  int width;
+  int height;
+  // Into storage, or into the mapping of the envmap.
+  const unsigned char* pixels;
+  std::vector<unsigned char> storage;
+};
+
+// Piecewise constant density over the texels of a coarse level, following
+// their luminance times the solid angle they cover. Rows are drawn from the
+// marginal CDF, then columns from the CDF of their row.
+struct EnvmapDistribution {
+    int level = 0;
+    int width = 0;
+    int height = 0;
+    // height + 1 entries.
+    std::vector<float> marginal;
+    // width + 1 entries per row.
+    std::vector<float> conditional;
+
+    bool empty() const {
+	return marginal.empty();
+    }
+};
+
+// Share of the resident tiles of an envmap, for the tiles whose index is
+// its own modulo the number of shards. Slots are allocated on first use up
+// to capacity, then the CLOCK hand evicts the first slot not referenced
+// since it last went by.
+struct EnvmapTileShard {
+    std::mutex mutex;
+    size_t capacity = 0;
+    std::vector<std::vector<unsigned char>> slot_pixels;
+    std::vector<uint32_t> slot_tile;
+    std::vector<uint8_t> slot_referenced;
+    size_t hand = 0;
+};
+
+// Shards of the tile cache, locked apart so that threads rarely wait.
+const size_t envmap_tile_shards = 16;
+
+// Levels of an envmap split into square tiles, read from a tile file on
+// first touch (see envmap_cache.hpp). At most capacity tiles are resident,
+// shared by all threads, so the parts of the envmap no ray looks at are
+// never read. They are freed with the envmap.
+struct EnvmapTiles {
+    struct Level {
+	int width;
+	int height;
+	int tiles_x;
+	uint32_t first_tile;
+    };
+
+    EnvmapTiles() = default;
+    EnvmapTiles(const EnvmapTiles&) = delete;
+    EnvmapTiles& operator=(const EnvmapTiles&) = delete;
+    ~EnvmapTiles() {
+	if (fd >= 0) close(fd);
+    }
+
+    int fd = -1;
+    // Texels along a side. Tiles on the right and bottom edges are padded.
+    int tile_size = 0;
+    size_t tile_bytes = 0;
+    // Offset of the first tile in the file.
+    uint64_t data_offset = 0;
+    uint32_t tile_count = 0;
+    std::vector<Level> levels;
+    size_t capacity = 0;
+    mutable std::vector<EnvmapTileShard> shards;
+    // Slot of every tile in its shard, or -1. Guarded by the shard lock.
+    mutable std::vector<int32_t> tile_slot;
+    // Tiles read from the file over all threads.
+    mutable std::atomic<size_t> reads{0};
+};
+
+struct Envmap {
+  int width;
+  int height;
+  int channels;
+
+  // Floats if hdr is set, bytes otherwise.
+  unsigned char* pixels;
+  bool hdr;
+  // Levels below the full resolution image, down to 1x1.
+  std::vector<EnvmapLevel> mips;
+  EnvmapDistribution distribution;
+
+  // File the pixels are mapped from, if they were not decoded.
+  void* mapping;
+  size_t mapping_bytes;
+  // Set instead of the pixels when they are read by tiles.
+  EnvmapTiles* tiles;
+};
+
+inline Envmap make_envmap(int width, int height, int channels, unsigned char* pixels) {
+    Envmap envmap;
+
+    envmap.width = width;
+    envmap.height = height;
+    envmap.channels = channels;
+    envmap.pixels = pixels;
+    envmap.hdr = false;
+    envmap.mapping = nullptr;
+    envmap.mapping_bytes = 0;
+    envmap.tiles = nullptr;
+
+    return envmap;
+}
+
+inline void free_envmap(Envmap& envmap) {
+    if (envmap.mapping) {
+	munmap(envmap.mapping, envmap.mapping_bytes);
+	envmap.mapping = nullptr;
+    } else {
+	stbi_image_free(envmap.pixels);
+    }
+    delete envmap.tiles;
+    envmap.tiles = nullptr;
+    envmap.pixels = nullptr;
+    envmap.mips.clear();
+    envmap.distribution = EnvmapDistribution();
+}
+
+inline size_t envmap_component_bytes(const Envmap& envmap) {
+    return envmap.hdr ? sizeof(float) : 1;
+}
+
+// Pixels of a level of the pyramid, 0 being the full image.
+inline const unsigned char* envmap_level(const Envmap& envmap, int level, int& width, int& height) {
+    if (level == 0) {
+	width = envmap.width;
+	height = envmap.height;
+	return envmap.pixels;
+    }
+    width = envmap.mips[level - 1].width;
+    height = envmap.mips[level - 1].height;
+    return envmap.mips[level - 1].pixels;
+}
+
+// Texel in the units it is stored in: 0 to 255 for 8-bit envmaps.
+template <typename T>
+Vec3<T> envmap_texel(const Envmap& envmap, const unsigned char* pixels, size_t index) {
+    if (envmap.hdr) {
+	float rgb[3];
+	std::memcpy(rgb, pixels + index * envmap.channels * sizeof(float), sizeof(rgb));
+	return Vec3<T>(rgb[0], rgb[1], rgb[2]);
+    }
+    const unsigned char* p = pixels + index * envmap.channels;
+    return Vec3<T>(p[0], p[1], p[2]);
+}
+
+// Splits the capacity of the tiles between their shards.
+inline void init_envmap_tile_cache(EnvmapTiles& tiles) {
+    tiles.tile_slot.assign(tiles.tile_count, -1);
+    tiles.shards = std::vector<EnvmapTileShard>(std::min(envmap_tile_shards, tiles.capacity));
+    for (size_t i = 0;i < tiles.shards.size();++i) {
+	tiles.shards[i].capacity = tiles.capacity / tiles.shards.size() + (i < tiles.capacity % tiles.shards.size());
+    }
+}
+
+// Pixels of a tile, read into its shard if it is not resident. The shard
+// must be locked, and the pixels are only valid until it is unlocked.
+// Unreadable tiles are black.
+inline const unsigned char* envmap_tile(const EnvmapTiles& tiles, EnvmapTileShard& shard, uint32_t tile) {
+    int32_t slot = tiles.tile_slot[tile];
+    if (slot < 0) {
+	if (shard.slot_tile.size() < shard.capacity) {
+	    slot = (int32_t)shard.slot_tile.size();
+	    shard.slot_pixels.emplace_back(tiles.tile_bytes);
+	    shard.slot_tile.push_back(tile);
+	    shard.slot_referenced.push_back(0);
+	} else {
+	    while (shard.slot_referenced[shard.hand]) {
+		shard.slot_referenced[shard.hand] = 0;
+		shard.hand = (shard.hand + 1) % shard.capacity;
+	    }
+	    slot = (int32_t)shard.hand;
+	    shard.hand = (shard.hand + 1) % shard.capacity;
+	    tiles.tile_slot[shard.slot_tile[slot]] = -1;
+	    shard.slot_tile[slot] = tile;
+	}
+	tiles.tile_slot[tile] = slot;
+
+	unsigned char* pixels = shard.slot_pixels[slot].data();
+	off_t offset = (off_t)(tiles.data_offset + (uint64_t)tile * tiles.tile_bytes);
+	if (pread(tiles.fd, pixels, tiles.tile_bytes, offset) != (ssize_t)tiles.tile_bytes) {
+	    std::memset(pixels, 0, tiles.tile_bytes);
+	}
+	++tiles.reads;
+    }
+    shard.slot_referenced[slot] = 1;
+    return shard.slot_pixels[slot].data();
+}
+
+// The four texels (x0, y0), (x1, y0), (x0, y1) and (x1, y1) of a bilinear
+// lookup in a level, copied with the shard of each tile they lie in locked
+// once: a single lock but for footprints straddling tile edges.
+template <typename T>
+void envmap_tile_texels(const Envmap& envmap, int level, int x0, int y0, int x1, int y1, Vec3<T> texels[4]) {
+    const EnvmapTiles& tiles = *envmap.tiles;
+    const EnvmapTiles::Level& tiled = tiles.levels[level];
+    const int xs[4] = {x0, x1, x0, x1}, ys[4] = {y0, y0, y1, y1};
+    uint32_t tile[4];
+    for (int k = 0;k < 4;++k) {
+	tile[k] = tiled.first_tile + (uint32_t)(ys[k] / tiles.tile_size * tiled.tiles_x + xs[k] / tiles.tile_size);
+    }
+    int copied = 0;
+    for (int k = 0;k < 4;++k) {
+	if (copied & (1 << k)) continue;
+	EnvmapTileShard& shard = tiles.shards[tile[k] % tiles.shards.size()];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	const unsigned char* pixels = envmap_tile(tiles, shard, tile[k]);
+	for (int m = k;m < 4;++m) {
+	    if (tile[m] != tile[k]) continue;
+	    texels[m] = envmap_texel<T>(envmap, pixels, (size_t)(ys[m] % tiles.tile_size) * tiles.tile_size + xs[m] % tiles.tile_size);
+	    copied |= 1 << m;
+	}
+    }
+}
+
+inline unsigned char average(unsigned char a, unsigned char b, unsigned char c, unsigned char d) {
+    return (unsigned char)((a + b + c + d + 2) / 4);
+}
+
+inline float average(float a, float b, float c, float d) {
+    return (a + b + c + d) * 0.25f;
+}
+
+template <typename C>
+void downsample_envmap_level(const C* pixels, int width, int height, int channels, EnvmapLevel& level) {
+    level.width = std::max(1, width / 2);
+    level.height = std::max(1, height / 2);
+    level.storage.resize((size_t)level.width * level.height * channels * sizeof(C));
+    level.pixels = level.storage.data();
+    C* target = (C*)level.storage.data();
+    for (int y = 0;y < level.height;++y) {
+	int y0 = 2 * y, y1 = std::min(2 * y + 1, height - 1);
+	for (int x = 0;x < level.width;++x) {
+	    int x0 = 2 * x, x1 = std::min(2 * x + 1, width - 1);
+	    for (int c = 0;c < channels;++c) {
+		target[((size_t)y * level.width + x) * channels + c] = average(
+		    pixels[((size_t)y0 * width + x0) * channels + c], pixels[((size_t)y0 * width + x1) * channels + c],
+		    pixels[((size_t)y1 * width + x0) * channels + c], pixels[((size_t)y1 * width + x1) * channels + c]);
+	    }
+	}
+    }
+}
+
+// Box filters every level from the one above. Texels of odd sized levels
+// average what is left of their 2x2 footprint.
+inline void build_envmap_mips(Envmap& envmap) {
+    envmap.mips.clear();
+    int width = envmap.width, height = envmap.height;
+    const unsigned char* pixels = envmap.pixels;
+    while (width > 1 || height > 1) {
+	EnvmapLevel level;
+	if (envmap.hdr) {
+	    downsample_envmap_level((const float*)pixels, width, height, envmap.channels, level);
+	} else {
+	    downsample_envmap_level(pixels, width, height, envmap.channels, level);
+	}
+	envmap.mips.push_back(std::move(level));
+	width = envmap.mips.back().width;
+	height = envmap.mips.back().height;
+	pixels = envmap.mips.back().pixels;
+    }
+}
+
+// Direction of the point (u, v) of the unit square the envmap is mapped to,
+// the inverse of the mapping of sample_envmap(): u follows the angle around
+// the vertical axis from -z, and v the angle atan2(1 - y^2, y) over pi.
+template <typename T>
+Vec3<T> envmap_direction(T u, T v) {
+    T phi = (2 * u - 1) * T(M_PI);
+    T alpha = v * T(M_PI);
+    T sin_alpha = std::sin(alpha), cos_alpha = std::cos(alpha);
+    T y = 2 * cos_alpha / (sin_alpha + std::sqrt(sin_alpha * sin_alpha + 4 * cos_alpha * cos_alpha));
+    T r = std::sqrt(std::max(T(0), 1 - y * y));
+    return Vec3<T>(-std::sin(phi) * r, y, -std::cos(phi) * r);
+}
+
+// Solid angle per unit area of the unit square at v.
+template <typename T>
+T envmap_jacobian(T v) {
+    T alpha = v * T(M_PI);
+    T sin_alpha = std::sin(alpha), cos_alpha = std::cos(alpha);
+    T y = 2 * cos_alpha / (sin_alpha + std::sqrt(sin_alpha * sin_alpha + 4 * cos_alpha * cos_alpha));
+    T dy_dalpha = (cos_alpha * y + sin_alpha * (1 - y * y)) / (sin_alpha + 2 * y * cos_alpha);
+    return T(2 * M_PI * M_PI) * std::fabs(dy_dalpha);
+}
+
+// Builds the distribution on the first level at most max_width texels
+// wide. A hundredth of the mean luminance is added to every texel so that
+// dark texels, which filtering can still bleed light into, keep a chance.
+inline void build_envmap_distribution(Envmap& envmap, int max_width = 512) {
+    EnvmapDistribution& distribution = envmap.distribution;
+    distribution.level = 0;
+    while (distribution.level < (int)envmap.mips.size() && (distribution.level == 0 ? envmap.width : envmap.mips[distribution.level - 1].width) > max_width) {
+	++distribution.level;
+    }
+    const unsigned char* pixels = envmap_level(envmap, distribution.level, distribution.width, distribution.height);
+    const int width = distribution.width, height = distribution.height;
+
+    std::vector<double> luminance((size_t)width * height);
+    double mean = 0;
+    for (size_t i = 0;i < luminance.size();++i) {
+	Vec3<double> texel = envmap_texel<double>(envmap, pixels, i);
+	luminance[i] = std::max(0.0, 0.2126 * texel.x + 0.7152 * texel.y + 0.0722 * texel.z);
+	mean += luminance[i] / luminance.size();
+    }
+
+    distribution.marginal.assign(height + 1, 0);
+    distribution.conditional.assign((size_t)height * (width + 1), 0);
+    std::vector<double> row_sums(height);
+    double total = 0;
+    for (int y = 0;y < height;++y) {
+	double jacobian = envmap_jacobian((y + 0.5) / height);
+	float* cdf = &distribution.conditional[(size_t)y * (width + 1)];
+	double sum = 0;
+	std::vector<double> row(width + 1, 0);
+	for (int x = 0;x < width;++x) {
+	    sum += (luminance[(size_t)y * width + x] + 0.01 * mean + 1e-12) * jacobian;
+	    row[x + 1] = sum;
+	}
+	for (int x = 1;x <= width;++x) {
+	    cdf[x] = (float)(row[x] / sum);
+	}
+	cdf[width] = 1;
+	row_sums[y] = sum;
+	total += sum;
+    }
+    double sum = 0;
+    for (int y = 0;y < height;++y) {
+	sum += row_sums[y];
+	distribution.marginal[y + 1] = (float)(sum / total);
+    }
+    distribution.marginal[height] = 1;
+}
+
+inline bool load_envmap(const char* path, Envmap& envmap) {
+    envmap.mapping = nullptr;
+    envmap.mapping_bytes = 0;
+    envmap.tiles = nullptr;
+    envmap.hdr = stbi_is_hdr(path);
+    if (envmap.hdr) {
+	envmap.pixels = (unsigned char*)stbi_loadf(path, &envmap.width, &envmap.height, &envmap.channels, 0);
+    } else {
+	envmap.pixels = stbi_load(path, &envmap.width, &envmap.height, &envmap.channels, 0);
+    }
+    if (envmap.pixels == 0 || envmap.channels < 3) {
+	return false;
+    }
+    build_envmap_mips(envmap);
+    build_envmap_distribution(envmap);
+    return true;
+}
+
+template <typename T>
+T clampf(T value, T min, T max) {
+    if (value > max) return max;
+    if (value < min) return min;
+    return value;
+}
+
+inline int clamp(int value, int min, int max) {
+    if (value > max) return max;
+    if (value < min) return min;
+    return value;
+}
+
+// Bilinear lookup in a level of the pyramid, 0 being the full image, at
+// (x, y) in texels of the full image. Columns wrap around and rows clamp.
+template <typename T>
+Vec3<T> sample_envmap_level(const Envmap& envmap, int level, T x, T y) {
+    int width, height;
+    const unsigned char* pixels = envmap_level(envmap, level, width, height);
+
+    T u = x * width / envmap.width - T(0.5);
+    T v = y * height / envmap.height - T(0.5);
+    T x_floor = std::floor(u), y_floor = std::floor(v);
+    T fx = u - x_floor, fy = v - y_floor;
+    int x0 = ((int)x_floor % width + width) % width;
+    int x1 = (x0 + 1) % width;
+    int y0 = clamp((int)y_floor, 0, height - 1);
+    int y1 = clamp((int)y_floor + 1, 0, height - 1);
+
+    Vec3<T> texels[4];
+    if (envmap.tiles) {
+	envmap_tile_texels(envmap, level, x0, y0, x1, y1, texels);
+    } else {
+	texels[0] = envmap_texel<T>(envmap, pixels, (size_t)y0 * width + x0);
+	texels[1] = envmap_texel<T>(envmap, pixels, (size_t)y0 * width + x1);
+	texels[2] = envmap_texel<T>(envmap, pixels, (size_t)y1 * width + x0);
+	texels[3] = envmap_texel<T>(envmap, pixels, (size_t)y1 * width + x1);
+    }
+    Vec3<T> top = texels[0] * (1 - fx) + texels[1] * fx;
+    Vec3<T> bottom = texels[2] * (1 - fx) + texels[3] * fx;
+    return (top * (1 - fy) + bottom * fy) * (envmap.hdr ? T(1) : T(1.0 / 255.0));
+}
+
+// Radiance from direction, filtered over the footprint of the lookup, the
+// angle in radians spread by the cone of rays it stands for. Footprints
+// below a texel are filtered bilinearly, larger ones trilinearly between
+// the two closest levels of the pyramid. Angles come from fast_atan2() in
+// fast math mode.
+template <typename T>
+Vec3<T> sample_envmap(const Envmap& envmap, Vec3<T> direction, T footprint = 0, bool fast_math = false) {
+    Vec2<T> xz_direction(direction.x, direction.z);
+    // The angle does not depend on the length, left as is in fast math mode:
+    // a zero length still gives NaN.
+    if (!fast_math) xz_direction.normalize();
+
+    Vec2<T> forward(0.0, -1.0);
+
+    T dot_xz = xz_direction * forward;
+    T det_xz = xz_direction.x * forward.y - xz_direction.y * forward.x;
+
+    T angle = shading_atan2(det_xz, dot_xz, fast_math);
+
+    Vec3<T> up(0.0, 1.0, 0.0);
+    Vec3<T> up_normal = cross(direction, up);
+
+    T dot_up = direction * up;
+    T det_up = direction.x * up.y * up_normal.z
+	+ up.x * up_normal.y * direction.z
+	- direction.z * up.y * up_normal.x
+	- up.z * up_normal.y * direction.x
+	- up_normal.z * direction.y * up.x;
+
+    T vertical_angle = shading_atan2(det_up, dot_up, fast_math);
+
+    T x = ((angle / M_PI) + 1.0) / 2.0 * (T)envmap.width;
+    T y = (vertical_angle / M_PI) * (T)envmap.height;
+    if (std::isnan(angle)) {
+	x = 0;
+    }
+    // Filtering would spread a NaN, where the nearest texel was looked up.
+    if (std::isnan(vertical_angle)) {
+	y = 0;
+    }
+
+    T texels = footprint * envmap.width / T(2 * M_PI);
+    if (!(texels > 1) || envmap.mips.empty()) {
+	return sample_envmap_level(envmap, 0, x, y);
+    }
+
+    T lod = std::min(std::log2(texels), (T)envmap.mips.size());
+    int level = std::min((int)lod, (int)envmap.mips.size() - 1);
+    T blend = std::min(T(1), lod - level);
+    return sample_envmap_level(envmap, level, x, y) * (1 - blend) + sample_envmap_level(envmap, level + 1, x, y) * blend;
+}
+
+// Direction drawn from the distribution of the envmap for the uniform
+// numbers u1 and u2, with its probability density over solid angles.
+template <typename T>
+Vec3<T> sample_envmap_direction(const Envmap& envmap, T u1, T u2, T& pdf) {
+    const EnvmapDistribution& distribution = envmap.distribution;
+    const float* marginal = distribution.marginal.data();
+    int y = (int)(std::upper_bound(marginal, marginal + distribution.height + 1, (float)u1) - marginal) - 1;
+    y = clamp(y, 0, distribution.height - 1);
+    const float* conditional = &distribution.conditional[(size_t)y * (distribution.width + 1)];
+    int x = (int)(std::upper_bound(conditional, conditional + distribution.width + 1, (float)u2) - conditional) - 1;
+    x = clamp(x, 0, distribution.width - 1);
+
+    T row_probability = marginal[y + 1] - marginal[y];
+    T column_probability = conditional[x + 1] - conditional[x];
+    T u = (x + clampf((u2 - conditional[x]) / column_probability, T(0), T(1))) / distribution.width;
+    T v = (y + clampf((u1 - marginal[y]) / row_probability, T(0), T(1))) / distribution.height;
+    pdf = row_probability * column_probability * distribution.width * distribution.height / envmap_jacobian(v);
+    return envmap_direction(u, v);
+}
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef ENVMAP_CACHE_HPP
+#define ENVMAP_CACHE_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "envmap.hpp"
+
+// Decoded envmaps, with their mip pyramid and importance distribution, are
+// kept in raw files that later runs map instead of decoding the source
+// again. A cache file is named after a hash of the canonical path of its
+// source, and only used while that path and the size and modification time
+// of the source match those it records. Sections are 64-byte aligned so the
+// pixels are used straight from the mapping, paged in on first touch.
+
+const uint64_t envmap_cache_version = 1;
+const size_t envmap_cache_alignment = 64;
+
+struct EnvmapCacheHeader {
+    char magic[8];
+    uint64_t version;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t path_bytes;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    int32_t hdr;
+    // Levels of the pyramid, the full image included.
+    uint32_t level_count;
+    int32_t distribution_level;
+    int32_t distribution_width;
+    int32_t distribution_height;
+    uint64_t marginal_offset;
+    uint64_t conditional_offset;
+    uint64_t file_bytes;
+};
+
+struct EnvmapCacheLevel {
+    int32_t width;
+    int32_t height;
+    uint64_t offset;
+};
+
+// Canonical path, size and modification time of the source of an envmap.
+struct EnvmapSource {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+};
+
+inline bool stat_envmap_source(const char* path, EnvmapSource& source) {
+    char canonical[PATH_MAX];
+    struct stat info;
+    if (!realpath(path, canonical) || stat(canonical, &info) != 0) return false;
+    source.path = canonical;
+    source.size = (uint64_t)info.st_size;
+    source.mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+inline std::string envmap_cache_path(const char* cache_dir, const EnvmapSource& source, const char* extension = ".cache") {
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : source.path) {
+	hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    char name[64];
+    std::snprintf(name, sizeof(name), "/envmap_%016llx%s", (unsigned long long)hash, extension);
+    return std::string(cache_dir) + name;
+}
+
+inline uint64_t align_cache_offset(uint64_t offset) {
+    return (offset + envmap_cache_alignment - 1) & ~(uint64_t)(envmap_cache_alignment - 1);
+}
+
+// Places the sections of the cache file of envmap after the header, the
+// source path and the level table.
+inline EnvmapCacheHeader envmap_cache_layout(const Envmap& envmap, const EnvmapSource& source, std::vector<EnvmapCacheLevel>& levels) {
+    EnvmapCacheHeader header = {};
+    std::memcpy(header.magic, "ENVMAP\0", 8);
+    header.version = envmap_cache_version;
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    header.path_bytes = (uint32_t)source.path.size();
+    header.width = envmap.width;
+    header.height = envmap.height;
+    header.channels = envmap.channels;
+    header.hdr = envmap.hdr;
+    header.level_count = (uint32_t)envmap.mips.size() + 1;
+    header.distribution_level = envmap.distribution.level;
+    header.distribution_width = envmap.distribution.width;
+    header.distribution_height = envmap.distribution.height;
+
+    uint64_t offset = sizeof(header) + header.path_bytes + header.level_count * sizeof(EnvmapCacheLevel);
+    levels.resize(header.level_count);
+    for (uint32_t i = 0;i < header.level_count;++i) {
+	int width, height;
+	envmap_level(envmap, (int)i, width, height);
+	offset = align_cache_offset(offset);
+	levels[i] = EnvmapCacheLevel{width, height, offset};
+	offset += (uint64_t)width * height * envmap.channels * envmap_component_bytes(envmap);
+    }
+    header.marginal_offset = align_cache_offset(offset);
+    header.conditional_offset = align_cache_offset(header.marginal_offset + envmap.distribution.marginal.size() * sizeof(float));
+    header.file_bytes = header.conditional_offset + envmap.distribution.conditional.size() * sizeof(float);
+    return header;
+}
+
+// Written next to its final name and renamed, so that concurrent runs never
+// map a partial file.
+inline bool write_envmap_cache(const std::string& cache_path, const EnvmapSource& source, const Envmap& envmap) {
+    std::vector<EnvmapCacheLevel> levels;
+    EnvmapCacheHeader header = envmap_cache_layout(envmap, source, levels);
+
+    std::string temporary = cache_path + ".tmp" + std::to_string(getpid());
+    std::ofstream ofs(temporary, std::ios::binary);
+    if (!ofs) return false;
+    uint64_t position = 0;
+    auto write = [&](const void* data, size_t bytes) {
+	ofs.write((const char*)data, bytes);
+	position += bytes;
+    };
+    auto pad_to = [&](uint64_t offset) {
+	static const char zeros[envmap_cache_alignment] = {};
+	write(zeros, offset - position);
+    };
+    write(&header, sizeof(header));
+    write(source.path.data(), source.path.size());
+    write(levels.data(), levels.size() * sizeof(EnvmapCacheLevel));
+    for (uint32_t i = 0;i < header.level_count;++i) {
+	int width, height;
+	const unsigned char* pixels = envmap_level(envmap, (int)i, width, height);
+	pad_to(levels[i].offset);
+	write(pixels, (size_t)width * height * envmap.channels * envmap_component_bytes(envmap));
+    }
+    pad_to(header.marginal_offset);
+    write(envmap.distribution.marginal.data(), envmap.distribution.marginal.size() * sizeof(float));
+    pad_to(header.conditional_offset);
+    write(envmap.distribution.conditional.data(), envmap.distribution.conditional.size() * sizeof(float));
+    ofs.close();
+
+    if (!ofs || std::rename(temporary.c_str(), cache_path.c_str()) != 0) {
+	std::remove(temporary.c_str());
+	return false;
+    }
+    return true;
+}
+
+// Maps the cache file if it is complete and was made from source as it is
+// now.
+inline bool map_envmap_cache(const std::string& cache_path, const EnvmapSource& source, Envmap& envmap) {
+    int fd = open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(EnvmapCacheHeader)) {
+	mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    const unsigned char* data = (const unsigned char*)mapping;
+    const size_t bytes = info.st_size;
+    EnvmapCacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    bool valid = std::memcmp(header.magic, "ENVMAP\0", 8) == 0 && header.version == envmap_cache_version
+	&& header.file_bytes == bytes && header.source_size == source.size && header.source_mtime == source.mtime
+	&& header.path_bytes == source.path.size() && header.level_count > 0
+	&& sizeof(header) + header.path_bytes + (uint64_t)header.level_count * sizeof(EnvmapCacheLevel) <= bytes
+	&& std::memcmp(data + sizeof(header), source.path.data(), header.path_bytes) == 0;
+    if (!valid) {
+	munmap(mapping, bytes);
+	return false;
+    }
+
+    std::vector<EnvmapCacheLevel> levels(header.level_count);
+    std::memcpy(levels.data(), data + sizeof(header) + header.path_bytes, levels.size() * sizeof(EnvmapCacheLevel));
+
+    // Every section must lie within the mapping, at an aligned offset,
+    // before it is used.
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+	return offset % envmap_cache_alignment == 0 && offset <= bytes && count <= (bytes - offset) / size;
+    };
+    const uint64_t component_bytes = header.hdr ? sizeof(float) : 1;
+    valid = header.channels >= 3 && header.channels <= 4 && (header.hdr == 0 || header.hdr == 1)
+	&& levels[0].width == header.width && levels[0].height == header.height;
+    for (const EnvmapCacheLevel& level : levels) {
+	valid = valid && level.width > 0 && level.height > 0
+	    && fits(level.offset, (uint64_t)level.width * level.height * header.channels, component_bytes);
+    }
+    // An envmap without a distribution is written with a 0x0 one; any other
+    // must have texels to draw from.
+    const bool has_distribution = header.distribution_width != 0 || header.distribution_height != 0;
+    valid = valid && (!has_distribution || (header.distribution_width > 0 && header.distribution_height > 0
+	&& fits(header.marginal_offset, (uint64_t)header.distribution_height + 1, sizeof(float))
+	&& fits(header.conditional_offset, (uint64_t)header.distribution_height * ((uint64_t)header.distribution_width + 1), sizeof(float))));
+    if (!valid) {
+	munmap(mapping, bytes);
+	return false;
+    }
+
+    envmap = make_envmap(header.width, header.height, header.channels, (unsigned char*)data + levels[0].offset);
+    envmap.hdr = header.hdr != 0;
+    envmap.mapping = mapping;
+    envmap.mapping_bytes = bytes;
+    for (uint32_t i = 1;i < header.level_count;++i) {
+	EnvmapLevel level;
+	level.width = levels[i].width;
+	level.height = levels[i].height;
+	level.pixels = data + levels[i].offset;
+	envmap.mips.push_back(std::move(level));
+    }
+
+    if (!has_distribution) return true;
+    EnvmapDistribution& distribution = envmap.distribution;
+    distribution.level = header.distribution_level;
+    distribution.width = header.distribution_width;
+    distribution.height = header.distribution_height;
+    const float* marginal = (const float*)(data + header.marginal_offset);
+    const float* conditional = (const float*)(data + header.conditional_offset);
+    distribution.marginal.assign(marginal, marginal + distribution.height + 1);
+    distribution.conditional.assign(conditional, conditional + (size_t)distribution.height * (distribution.width + 1));
+    return true;
+}
+
+// load_envmap() through the cache in cache_dir. A cache that cannot be
+// written only costs the decoding again on the next run.
+inline bool load_envmap_cached(const char* path, Envmap& envmap, const char* cache_dir) {
+    EnvmapSource source;
+    if (!stat_envmap_source(path, source)) return false;
+    std::string cache_path = envmap_cache_path(cache_dir, source);
+    if (map_envmap_cache(cache_path, source, envmap)) return true;
+
+    if (!load_envmap(path, envmap)) return false;
+    write_envmap_cache(cache_path, source, envmap);
+    return true;
+}
+
+// Tile files hold the same levels cut into square tiles, each stored
+// contiguously so that it is read with a single pread() when a ray first
+// touches it (see EnvmapTiles). Tiles follow each other level by level, in
+// rows, from a page-aligned offset.
+
+const uint64_t envmap_tiles_version = 1;
+const uint64_t envmap_tiles_alignment = 4096;
+const int envmap_tile_size = 64;
+
+struct EnvmapTileHeader {
+    char magic[8];
+    uint64_t version;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t path_bytes;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    int32_t hdr;
+    int32_t tile_size;
+    uint32_t level_count;
+    uint32_t tile_count;
+    int32_t distribution_level;
+    int32_t distribution_width;
+    int32_t distribution_height;
+    uint64_t marginal_offset;
+    uint64_t conditional_offset;
+    uint64_t data_offset;
+    uint64_t file_bytes;
+};
+
+// Levels of the tile file, their offset being the index of their first tile.
+inline EnvmapTileHeader envmap_tiles_layout(const Envmap& envmap, const EnvmapSource& source, int tile_size, std::vector<EnvmapCacheLevel>& levels) {
+    EnvmapTileHeader header = {};
+    std::memcpy(header.magic, "ENVTILE", 8);
+    header.version = envmap_tiles_version;
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    header.path_bytes = (uint32_t)source.path.size();
+    header.width = envmap.width;
+    header.height = envmap.height;
+    header.channels = envmap.channels;
+    header.hdr = envmap.hdr;
+    header.tile_size = tile_size;
+    header.level_count = (uint32_t)envmap.mips.size() + 1;
+    header.distribution_level = envmap.distribution.level;
+    header.distribution_width = envmap.distribution.width;
+    header.distribution_height = envmap.distribution.height;
+
+    levels.resize(header.level_count);
+    for (uint32_t i = 0;i < header.level_count;++i) {
+	int width, height;
+	envmap_level(envmap, (int)i, width, height);
+	levels[i] = EnvmapCacheLevel{width, height, header.tile_count};
+	header.tile_count += (uint32_t)(((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size));
+    }
+
+    uint64_t offset = sizeof(header) + header.path_bytes + header.level_count * sizeof(EnvmapCacheLevel);
+    header.marginal_offset = align_cache_offset(offset);
+    header.conditional_offset = align_cache_offset(header.marginal_offset + envmap.distribution.marginal.size() * sizeof(float));
+    offset = header.conditional_offset + envmap.distribution.conditional.size() * sizeof(float);
+    header.data_offset = (offset + envmap_tiles_alignment - 1) & ~(envmap_tiles_alignment - 1);
+    size_t tile_bytes = (size_t)tile_size * tile_size * envmap.channels * envmap_component_bytes(envmap);
+    header.file_bytes = header.data_offset + (uint64_t)header.tile_count * tile_bytes;
+    return header;
+}
+
+inline bool write_all(int fd, const void* data, size_t bytes, uint64_t offset) {
+    const char* begin = (const char*)data;
+    while (bytes > 0) {
+	ssize_t written = pwrite(fd, begin, bytes, (off_t)offset);
+	if (written <= 0) return false;
+	begin += written;
+	bytes -= written;
+	offset += written;
+    }
+    return true;
+}
+
+// Tiles are cut and written by all threads at once. Like the cache, the
+// file is renamed into place once complete.
+inline bool write_envmap_tiles(const std::string& tile_path, const EnvmapSource& source, const Envmap& envmap, int tile_size) {
+    std::vector<EnvmapCacheLevel> levels;
+    EnvmapTileHeader header = envmap_tiles_layout(envmap, source, tile_size, levels);
+
+    std::string temporary = tile_path + ".tmp" + std::to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool written = ftruncate(fd, (off_t)header.file_bytes) == 0
+	&& write_all(fd, &header, sizeof(header), 0)
+	&& write_all(fd, source.path.data(), source.path.size(), sizeof(header))
+	&& write_all(fd, levels.data(), levels.size() * sizeof(EnvmapCacheLevel), sizeof(header) + header.path_bytes)
+	&& write_all(fd, envmap.distribution.marginal.data(), envmap.distribution.marginal.size() * sizeof(float), header.marginal_offset)
+	&& write_all(fd, envmap.distribution.conditional.data(), envmap.distribution.conditional.size() * sizeof(float), header.conditional_offset);
+
+    const size_t texel_bytes = (size_t)envmap.channels * envmap_component_bytes(envmap);
+    const size_t tile_bytes = (size_t)tile_size * tile_size * texel_bytes;
+    for (uint32_t i = 0;written && i < header.level_count;++i) {
+	int width, height;
+	const unsigned char* pixels = envmap_level(envmap, (int)i, width, height);
+	const int tiles_x = (width + tile_size - 1) / tile_size;
+	const int tiles = tiles_x * ((height + tile_size - 1) / tile_size);
+	bool level_written = true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:level_written)
+	for (int t = 0;t < tiles;++t) {
+	    std::vector<unsigned char> tile(tile_bytes, 0);
+	    const int x0 = t % tiles_x * tile_size;
+	    const int y0 = t / tiles_x * tile_size;
+	    const int columns = std::min(tile_size, width - x0);
+	    for (int y = 0;y < std::min(tile_size, height - y0);++y) {
+		std::memcpy(&tile[(size_t)y * tile_size * texel_bytes], pixels + ((size_t)(y0 + y) * width + x0) * texel_bytes, columns * texel_bytes);
+	    }
+	    level_written = write_all(fd, tile.data(), tile_bytes, header.data_offset + (uint64_t)(levels[i].offset + t) * tile_bytes) && level_written;
+	}
+	written = level_written;
+    }
+    written = close(fd) == 0 && written;
+
+    if (!written || std::rename(temporary.c_str(), tile_path.c_str()) != 0) {
+	std::remove(temporary.c_str());
+	return false;
+    }
+    return true;
+}
+
+inline bool read_all(int fd, void* data, size_t bytes, uint64_t offset) {
+    return pread(fd, data, bytes, (off_t)offset) == (ssize_t)bytes;
+}
+
+// Opens the tile file if it is complete and was made from source as it is
+// now. Only the header, the level table and the distribution are read; up
+// to resident_bytes of tiles are kept.
+inline bool open_envmap_tiles(const std::string& tile_path, const EnvmapSource& source, Envmap& envmap, size_t resident_bytes) {
+    int fd = open(tile_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    EnvmapTileHeader header;
+    std::string path(source.path.size(), '\0');
+    bool valid = fstat(fd, &info) == 0 && read_all(fd, &header, sizeof(header), 0)
+	&& std::memcmp(header.magic, "ENVTILE", 8) == 0 && header.version == envmap_tiles_version
+	&& header.file_bytes == (uint64_t)info.st_size && header.source_size == source.size && header.source_mtime == source.mtime
+	&& header.path_bytes == source.path.size() && header.level_count > 0 && header.tile_size > 0
+	&& read_all(fd, &path[0], path.size(), sizeof(header)) && path == source.path;
+    // Sizes are checked against the file before anything is allocated or
+    // read from them.
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+	return offset <= header.file_bytes && count <= (header.file_bytes - offset) / size;
+    };
+    valid = valid && header.channels >= 3 && header.channels <= 4 && (header.hdr == 0 || header.hdr == 1) && header.tile_size <= 4096
+	&& fits(sizeof(header) + header.path_bytes, header.level_count, sizeof(EnvmapCacheLevel))
+	&& fits(header.data_offset, header.tile_count, (uint64_t)header.tile_size * header.tile_size * header.channels * (header.hdr ? sizeof(float) : 1));
+    // As in map_envmap_cache(), a distribution is either 0x0 or not empty.
+    const bool has_distribution = header.distribution_width != 0 || header.distribution_height != 0;
+    valid = valid && (!has_distribution || (header.distribution_width > 0 && header.distribution_height > 0
+	&& fits(header.marginal_offset, (uint64_t)header.distribution_height + 1, sizeof(float))
+	&& fits(header.conditional_offset, (uint64_t)header.distribution_height * ((uint64_t)header.distribution_width + 1), sizeof(float))));
+    std::vector<EnvmapCacheLevel> levels;
+    EnvmapDistribution distribution;
+    if (valid) {
+	levels.resize(header.level_count);
+	valid = read_all(fd, levels.data(), levels.size() * sizeof(EnvmapCacheLevel), sizeof(header) + header.path_bytes)
+	    && levels[0].width == header.width && levels[0].height == header.height;
+	if (has_distribution) {
+	    distribution.level = header.distribution_level;
+	    distribution.width = header.distribution_width;
+	    distribution.height = header.distribution_height;
+	    distribution.marginal.resize(distribution.height + 1);
+	    distribution.conditional.resize((size_t)distribution.height * (distribution.width + 1));
+	    valid = valid && read_all(fd, distribution.marginal.data(), distribution.marginal.size() * sizeof(float), header.marginal_offset)
+		&& read_all(fd, distribution.conditional.data(), distribution.conditional.size() * sizeof(float), header.conditional_offset);
+	}
+	// Every tile of every level must be in the file.
+	for (const EnvmapCacheLevel& level : levels) {
+	    uint64_t tiles_x = ((uint64_t)level.width + header.tile_size - 1) / header.tile_size;
+	    uint64_t tiles_y = ((uint64_t)level.height + header.tile_size - 1) / header.tile_size;
+	    valid = valid && level.width > 0 && level.height > 0 && level.offset <= header.tile_count
+		&& tiles_x * tiles_y <= header.tile_count - level.offset;
+	}
+    }
+    if (!valid) {
+	close(fd);
+	return false;
+    }
+
+    EnvmapTiles* tiles = new EnvmapTiles;
+    tiles->fd = fd;
+    tiles->tile_size = header.tile_size;
+    tiles->tile_bytes = (size_t)header.tile_size * header.tile_size * header.channels * (header.hdr ? sizeof(float) : 1);
+    tiles->data_offset = header.data_offset;
+    tiles->tile_count = header.tile_count;
+    for (const EnvmapCacheLevel& level : levels) {
+	tiles->levels.push_back(EnvmapTiles::Level{level.width, level.height, (level.width + header.tile_size - 1) / header.tile_size, (uint32_t)level.offset});
+    }
+    // Room for the up to eight tiles of a trilinear lookup, so that
+    // neighbouring lookups do not keep evicting each other's tiles. Texels
+    // are copied out under the shard lock, so this is not needed for
+    // correctness.
+    tiles->capacity = std::max<size_t>(8, resident_bytes / tiles->tile_bytes);
+    init_envmap_tile_cache(*tiles);
+
+    envmap = make_envmap(header.width, header.height, header.channels, nullptr);
+    envmap.hdr = header.hdr != 0;
+    envmap.tiles = tiles;
+    for (uint32_t i = 1;i < header.level_count;++i) {
+	EnvmapLevel level;
+	level.width = levels[i].width;
+	level.height = levels[i].height;
+	level.pixels = nullptr;
+	envmap.mips.push_back(std::move(level));
+    }
+    envmap.distribution = std::move(distribution);
+    return true;
+}
+
+// Envmap read by tiles from a tile file in cache_dir, made from a decoded
+// envmap the first time. Only that first run holds the whole image.
+inline bool load_envmap_tiled(const char* path, Envmap& envmap, const char* cache_dir, size_t resident_bytes) {
+    EnvmapSource source;
+    if (!stat_envmap_source(path, source)) return false;
+    std::string tile_path = envmap_cache_path(cache_dir, source, ".tiles");
+    if (open_envmap_tiles(tile_path, source, envmap, resident_bytes)) return true;
+
+    Envmap decoded;
+    if (!load_envmap(path, decoded)) return false;
+    bool written = write_envmap_tiles(tile_path, source, decoded, envmap_tile_size);
+    free_envmap(decoded);
+    if (!written) {
+	std::cerr << "Cannot write the envmap tiles to " << tile_path << std::endl;
+	return false;
+    }
+    return open_envmap_tiles(tile_path, source, envmap, resident_bytes);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef FAST_MATH_HPP
+#define FAST_MATH_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "geometry.hpp"
+
+// Approximations of the transcendental functions of shading, computed in
+// single precision whatever the pipeline. Loops over them vectorize: GCC
+// keeps a branch around floating point arithmetic that may trap, so results
+// are selected with bit masks and copysign() rather than conditionals.
+// raytracer_bench checks the error bounds given below.
+
+// value where the sign bit of x is set, 0 elsewhere.
+inline float if_sign_bit(float x, float value) {
+    return bits_float(float_bits(value) & (uint32_t)((int32_t)float_bits(x) >> 31));
+}
+
+// Odd polynomial of degree 11 for atan on [0, 1] (Abramowitz and Stegun
+// 4.4.49), unfolded over the octants: |error| < 1e-5 rad. (0, 0) gives NaN
+// instead of 0.
+inline float fast_atan2(float y, float x) {
+    float ax = std::fabs(x), ay = std::fabs(y);
+    float a = (ax < ay ? ax : ay) / (ax < ay ? ay : ax);
+    float s = a * a;
+    float r = a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f + s * (-0.11643287f + s * (0.05265332f - 0.01172120f * s)))));
+    // pi/2 - r past the diagonal, then pi - r for negative x, -0 included.
+    float diagonal = ax - ay;
+    r = if_sign_bit(diagonal, 1.57079633f) + std::copysign(r, diagonal);
+    r = if_sign_bit(x, 3.14159265f) + std::copysign(r, x);
+    return std::copysign(r, y);
+}
+
+// log2 of a positive normal float: the exponent is read from the bits, and
+// the mantissa m, brought into [sqrt(1/2), sqrt(2)), expanded in
+// t = (m - 1) / (m + 1) up to t^9: |error| < 2e-7 + 2e-7 |log2 x|.
+inline float fast_log2(float x) {
+    // Exponent relative to sqrt(1/2).
+    int32_t offset = (int32_t)float_bits(x) - (int32_t)0x3f3504f3;
+    int32_t exponent = offset >> 23;
+    float m = bits_float(float_bits(x) - ((uint32_t)exponent << 23));
+    float t = (m - 1) / (m + 1);
+    float t2 = t * t;
+    float series = t * (2.88539008f + t2 * (0.96179669f + t2 * (0.57707801f + t2 * (0.41219858f + t2 * 0.32059890f))));
+    return (float)exponent + series;
+}
+
+// 2^x as 2^n times a Taylor polynomial of degree 6 for 2^f, n being x
+// rounded and f = x - n in [-1/2, 1/2]: relative error < 3e-7 for x in
+// [-125, 127]. Below -125.5 results are flushed to 0 rather than made
+// denormal, which would slow down the arithmetic on them; above 127.5 they
+// stay finite. |x| must stay below 2^31.
+inline float fast_exp2(float x) {
+    // Truncation rounds down above -128.5, with no call to floor().
+    int32_t n = (int32_t)(x + 128.5f) - 128;
+    // Zeroes f too where flushed, lest the product below be denormal.
+    uint32_t underflow = n < -125 ? 0u : ~0u;
+    float f = bits_float(float_bits(x - (float)n) & underflow);
+    n = n > -125 ? n : -125;
+    n = n < 127 ? n : 127;
+    float p = 1 + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * (0.00961813f + f * (0.00133336f + f * 0.00015404f)))));
+    return bits_float(float_bits(p * bits_float((uint32_t)(n + 127) << 23)) & underflow);
+}
+
+// x^y for x >= 0 and y > 0, as exp2(y log2 x): the error of the logarithm
+// grows with y log2 x, for a relative error < 3e-7 + 2e-7 |y log2 x|.
+// Results below 2^-125.5 are flushed to 0 like those of fast_exp2().
+inline float fast_pow(float x, float y) {
+    float r = fast_exp2(y * fast_log2(x));
+    return bits_float(float_bits(r) & (x > 0 ? ~0u : 0u));
+}
+
+// 1/sqrt(x) by rsqrt_nr_ps(): relative error < 3e-7.
+inline float fast_rsqrt(float x) {
+    return _mm_cvtss_f32(rsqrt_nr_ps(_mm_set_ss(x)));
+}
+
+// The functions above in fast math mode, the standard ones otherwise.
+
+template <typename T>
+T shading_pow(T x, T y, bool fast) {
+    return fast ? T(fast_pow((float)x, (float)y)) : std::pow(x, y);
+}
+
+template <typename T>
+T shading_atan2(T y, T x, bool fast) {
+    return fast ? T(fast_atan2((float)y, (float)x)) : std::atan2(y, x);
+}
+
+#endif
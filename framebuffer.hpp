@@ -0,0 +1,161 @@
+#ifndef FRAMEBUFFER_HPP
+#define FRAMEBUFFER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "geometry.hpp"
+
+enum class FramebufferFormat {
+    // Three components in the precision of the pipeline.
+    Full,
+    // Three IEEE 754 half floats, 6 bytes per pixel.
+    Half,
+    // Three 8-bit mantissas sharing an exponent, 4 bytes per pixel.
+    RGBE
+};
+
+// Rounds to nearest even. Values past the half range become infinities and
+// the float denormal arithmetic takes care of the half denormals.
+inline uint16_t float_to_half(float value) {
+    const uint32_t infinity = 255u << 23;
+    const uint32_t half_overflow = (127u + 16) << 23;
+    const float denormal_magic = bits_float(((127u - 15) + (23 - 10) + 1) << 23);
+
+    uint32_t bits = float_bits(value);
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+
+    uint16_t half;
+    if (bits >= half_overflow) {
+	half = bits > infinity ? 0x7e00 : 0x7c00;
+    } else if (bits < (113u << 23)) {
+	half = (uint16_t)(float_bits(bits_float(bits) + denormal_magic) - float_bits(denormal_magic));
+    } else {
+	uint32_t mantissa_odd = (bits >> 13) & 1;
+	bits += ((uint32_t)(15 - 127) << 23) + 0xfff;
+	bits += mantissa_odd;
+	half = (uint16_t)(bits >> 13);
+    }
+    return half | (uint16_t)(sign >> 16);
+}
+
+inline float half_to_float(uint16_t half) {
+    const uint32_t shifted_exponent = 0x7c00u << 13;
+    const float denormal_magic = bits_float(113u << 23);
+
+    uint32_t bits = (uint32_t)(half & 0x7fff) << 13;
+    uint32_t exponent = bits & shifted_exponent;
+    bits += (127u - 15) << 23;
+    if (exponent == shifted_exponent) {
+	bits += (128u - 16) << 23;
+    } else if (exponent == 0) {
+	bits = float_bits(bits_float(bits + (1u << 23)) - denormal_magic);
+    }
+    return bits_float(bits | (uint32_t)(half & 0x8000) << 16);
+}
+
+// Ward's shared exponent encoding, negative components are clamped to 0.
+template <typename T>
+uint32_t encode_rgbe(const Vec3<T>& color) {
+    T max = std::max(color.x, std::max(color.y, color.z));
+    if (!(max > T(1e-32))) return 0;
+
+    int exponent;
+    T scale = std::frexp(max, &exponent) * T(256) / max;
+    uint32_t r = (uint32_t)std::min(T(255), std::max(T(0), color.x * scale));
+    uint32_t g = (uint32_t)std::min(T(255), std::max(T(0), color.y * scale));
+    uint32_t b = (uint32_t)std::min(T(255), std::max(T(0), color.z * scale));
+    return r | g << 8 | b << 16 | (uint32_t)std::min(255, exponent + 128) << 24;
+}
+
+// Decodes to the middle of the quantization step.
+template <typename T>
+Vec3<T> decode_rgbe(uint32_t rgbe) {
+    int exponent = (int)(rgbe >> 24);
+    if (exponent == 0) return Vec3<T>(0, 0, 0);
+
+    T scale = std::ldexp(T(1), exponent - (128 + 8));
+    return Vec3<T>(((rgbe & 0xff) + T(0.5)) * scale, (((rgbe >> 8) & 0xff) + T(0.5)) * scale, (((rgbe >> 16) & 0xff) + T(0.5)) * scale);
+}
+
+// Image of width * height colors, stored in one of the formats above and
+// converted on access.
+template <typename T>
+struct Framebuffer {
+    explicit Framebuffer(FramebufferFormat format = FramebufferFormat::Full) : format(format) {}
+
+    FramebufferFormat format;
+    int width = 0;
+    int height = 0;
+    std::vector<unsigned char> data;
+
+    size_t pixel_bytes() const {
+	switch (format) {
+	case FramebufferFormat::Half: return 3 * sizeof(uint16_t);
+	case FramebufferFormat::RGBE: return sizeof(uint32_t);
+	default: return 3 * sizeof(T);
+	}
+    }
+
+    size_t size() const {
+	return (size_t)width * height;
+    }
+
+    void resize(int width, int height) {
+	this->width = width;
+	this->height = height;
+	data.resize(size() * pixel_bytes());
+    }
+
+    void store(size_t pixel, const Vec3<T>& color) {
+	unsigned char* p = &data[pixel * pixel_bytes()];
+	switch (format) {
+	case FramebufferFormat::Half: {
+	    uint16_t half[3] = {float_to_half((float)color.x), float_to_half((float)color.y), float_to_half((float)color.z)};
+	    std::memcpy(p, half, sizeof(half));
+	    break;
+	}
+	case FramebufferFormat::RGBE: {
+	    uint32_t rgbe = encode_rgbe(color);
+	    std::memcpy(p, &rgbe, sizeof(rgbe));
+	    break;
+	}
+	default: {
+	    T full[3] = {color.x, color.y, color.z};
+	    std::memcpy(p, full, sizeof(full));
+	    break;
+	}
+	}
+    }
+
+    Vec3<T> load(size_t pixel) const {
+	const unsigned char* p = &data[pixel * pixel_bytes()];
+	switch (format) {
+	case FramebufferFormat::Half: {
+	    uint16_t half[3];
+	    std::memcpy(half, p, sizeof(half));
+	    return Vec3<T>(half_to_float(half[0]), half_to_float(half[1]), half_to_float(half[2]));
+	}
+	case FramebufferFormat::RGBE: {
+	    uint32_t rgbe;
+	    std::memcpy(&rgbe, p, sizeof(rgbe));
+	    return decode_rgbe<T>(rgbe);
+	}
+	default: {
+	    T full[3];
+	    std::memcpy(full, p, sizeof(full));
+	    return Vec3<T>(full[0], full[1], full[2]);
+	}
+	}
+    }
+
+    size_t memory_bytes() const {
+	return data.capacity();
+    }
+};
+
+#endif
@@ -1,25 +1,71 @@
 #ifndef GEOMETRY_HPP
 #define GEOMETRY_HPP
 
+#include <algorithm>
+#include <cassert>
 #include <cmath>
-#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+inline uint32_t float_bits(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
 
-struct Vec4f {
-    Vec4f() : Vec4f(0.0f, 0.0f, 0.0f, 0.0f) {}
-    Vec4f(float x, float y, float z, float w) {
-	this->x = x;
-	this->y = y;
-	this->z = z;
-	this->w = w;
-    }
+inline float bits_float(uint32_t bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
 
-    float x;
-    float y;
-    float z;
-    float w;
+// Dot product of the four lanes, broadcast to every lane.
+inline __m128 dot_broadcast_ps(__m128 a, __m128 b) {
+    __m128 m = _mm_mul_ps(a, b);
+    __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+}
 
-    Vec4f& normalize() {
-	float norm = sqrtf(x * x + y * y + z * z + w * w);
+// Approximate 1/sqrt(x) refined by one Newton-Raphson step (~23 bits).
+inline __m128 rsqrt_nr_ps(__m128 x) {
+    __m128 r = _mm_rsqrt_ps(x);
+    __m128 half_x = _mm_mul_ps(_mm_set1_ps(0.5f), x);
+    return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(half_x, _mm_mul_ps(r, r))));
+}
+
+// The generic vectors are literal types, usable in constant expressions but
+// for their norms and element access; the SSE specializations are not.
+
+template <typename T> struct Vec2;
+template <typename T> struct Vec3;
+template <typename T> struct Vec4;
+
+typedef Vec2<float> Vec2f;
+typedef Vec3<float> Vec3f;
+typedef Vec4<float> Vec4f;
+typedef Vec2<double> Vec2d;
+typedef Vec3<double> Vec3d;
+typedef Vec4<double> Vec4d;
+
+template <typename T>
+struct Vec4 {
+    constexpr Vec4() : Vec4(T(0), T(0), T(0), T(0)) {}
+    constexpr Vec4(T x, T y, T z, T w) : x(x), y(y), z(z), w(w) {}
+
+    union {
+	struct {
+	    T x;
+	    T y;
+	    T z;
+	    T w;
+	};
+	T data[4];
+    };
+
+    Vec4& normalize() {
+	T norm = this->norm();
 	x /= norm;
 	y /= norm;
 	z /= norm;
@@ -28,64 +74,61 @@ struct Vec4f {
 	return *this;
     }
 
-    float norm() {
-	return sqrtf(x * x + y * y + z * z + w * w);
+    T norm() const {
+	return std::sqrt(x * x + y * y + z * z + w * w);
     }
 
-    float operator[](int index) {
-	switch(index) {
-	    case 0:
-		return x;
-	    case 1:
-		return y;
-	    case 2:
-		return z;
-	    case 3:
-		return w;
-	    default:
-		throw std::runtime_error("Invalid Index");
-	}
+    T operator[](int index) const {
+	assert(index >= 0 && index < 4);
+	return data[index];
     }
 
-    Vec4f operator-(const Vec4f& b) const {
-	return Vec4f(this->x - b.x, this->y - b.y, this->z - b.z, this->w - b.w);
+    T& operator[](int index) {
+	assert(index >= 0 && index < 4);
+	return data[index];
     }
 
-    Vec4f operator+(const Vec4f& b) const {
-	return Vec4f(this->x + b.x, this->y + b.y, this->z + b.z, this->w - b.w);
+    constexpr Vec4 operator-(const Vec4& b) const {
+	return Vec4(this->x - b.x, this->y - b.y, this->z - b.z, this->w - b.w);
     }
 
-    float operator*(const Vec4f& b) const {
-	return this->x * b.x + this->y * b.y + this->z * b.z + this->w * b.w;
+    constexpr Vec4 operator+(const Vec4& b) const {
+	return Vec4(this->x + b.x, this->y + b.y, this->z + b.z, this->w + b.w);
     }
 
-    Vec4f operator*(const float& f) const {
-	return Vec4f(x * f, y * f, z * f, w * f);
+    constexpr T operator*(const Vec4& b) const {
+	return this->x * b.x + this->y * b.y + this->z * b.z + this->w * b.w;
     }
 
-    Vec4f operator/(const float& f) const {
-	return Vec4f(x / f, y / f, z / f, w / f);
+    constexpr Vec4 operator*(const T& f) const {
+	return Vec4(x * f, y * f, z * f, w * f);
     }
 
-    Vec4f operator-() const {
-	return Vec4f(-x, -y, -z, -w);
+    constexpr Vec4 operator/(const T& f) const {
+	return Vec4(x / f, y / f, z / f, w / f);
     }
-};
 
-struct Vec3f {
-    Vec3f() : Vec3f(0.0f, 0.0f, 0.0f) {}
-    Vec3f(float x, float y, float z) {
-	this->x = x;
-	this->y = y;
-	this->z = z;
+    constexpr Vec4 operator-() const {
+	return Vec4(-x, -y, -z, -w);
     }
+};
 
-    float x;
-    float y;
-    float z;
-
-    Vec3f& normalize() {
-	float norm = sqrtf(x * x + y * y + z * z);
+template <typename T>
+struct Vec3 {
+    constexpr Vec3() : Vec3(T(0), T(0), T(0)) {}
+    constexpr Vec3(T x, T y, T z) : x(x), y(y), z(z) {}
+
+    union {
+	struct {
+	    T x;
+	    T y;
+	    T z;
+	};
+	T data[3];
+    };
+
+    Vec3& normalize() {
+	T norm = this->norm();
 	x /= norm;
 	y /= norm;
 	z /= norm;
@@ -93,105 +136,344 @@ struct Vec3f {
 	return *this;
     }
 
-    float norm() {
-	return sqrtf(x * x + y * y + z * z);
+    T norm() const {
+	return std::sqrt(x * x + y * y + z * z);
     }
 
-    float operator[](int index) {
-	switch(index) {
-	    case 0:
-		return x;
-	    case 1:
-		return y;
-	    case 2:
-		return z;
-	    default:
-		throw std::runtime_error("Invalid Index");
-	}
+    // Index 0, 1 or 2, as for Vec3<float>.
+    T operator[](int index) const {
+	assert(index >= 0 && index < 3);
+	return data[index];
     }
 
-    Vec3f operator-(const Vec3f& b) const {
-	return Vec3f(this->x - b.x, this->y - b.y, this->z - b.z);
+    T& operator[](int index) {
+	assert(index >= 0 && index < 3);
+	return data[index];
     }
 
-    Vec3f operator+(const Vec3f& b) const {
-	return Vec3f(this->x + b.x, this->y + b.y, this->z + b.z);
+    constexpr Vec3 operator-(const Vec3& b) const {
+	return Vec3(this->x - b.x, this->y - b.y, this->z - b.z);
     }
 
-    float operator*(const Vec3f& b) const {
+    constexpr Vec3 operator+(const Vec3& b) const {
+	return Vec3(this->x + b.x, this->y + b.y, this->z + b.z);
+    }
+
+    constexpr T operator*(const Vec3& b) const {
 	return this->x * b.x + this->y * b.y + this->z * b.z;
     }
 
-    Vec3f operator*(const float& f) const {
-	return Vec3f(x * f, y * f, z * f);
+    constexpr Vec3 operator*(const T& f) const {
+	return Vec3(x * f, y * f, z * f);
     }
 
-    Vec3f operator/(const float& f) const {
-	return Vec3f(x / f, y / f, z / f);
+    constexpr Vec3 operator/(const T& f) const {
+	return Vec3(x / f, y / f, z / f);
     }
 
-    Vec3f operator-() const {
-	return Vec3f(-x, -y, -z);
+    constexpr Vec3 operator-() const {
+	return Vec3(-x, -y, -z);
     }
 };
 
-Vec3f cross(Vec3f& a, Vec3f& b) {
-    Vec3f result;
+template <typename T>
+constexpr Vec3<T> cross(const Vec3<T>& a, const Vec3<T>& b) {
+    return Vec3<T>(a.y * b.z - a.z * b.y,
+		   a.z * b.x - a.x * b.z,
+		   a.x * b.y - a.y * b.x);
+}
+
+template <typename T>
+Vec3<T> component_min(const Vec3<T>& a, const Vec3<T>& b) {
+    return Vec3<T>(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
 
-    result.x = a.y * b.z - a.z * b.y;
-    result.y = a.z * b.x - a.x * b.z;
-    result.z = a.x * b.y - a.y * b.x;
+template <typename T>
+Vec3<T> component_max(const Vec3<T>& a, const Vec3<T>& b) {
+    return Vec3<T>(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
 
-    return result;
+template <typename T>
+constexpr Vec3<T> component_mul(const Vec3<T>& a, const Vec3<T>& b) {
+    return Vec3<T>(a.x * b.x, a.y * b.y, a.z * b.z);
 }
 
-struct Vec2f {
-    Vec2f() : Vec2f(0.0f, 0.0f) {}
-    Vec2f(float x, float y) {
-	this->x = x;
-	this->y = y;
+// SSE specializations for single precision.
+
+template <>
+struct alignas(16) Vec4<float> {
+    Vec4() : simd(_mm_setzero_ps()) {}
+    Vec4(float x, float y, float z, float w) : simd(_mm_setr_ps(x, y, z, w)) {}
+    explicit Vec4(__m128 v) : simd(v) {}
+
+    union {
+	__m128 simd;
+	struct {
+	    float x;
+	    float y;
+	    float z;
+	    float w;
+	};
+	float data[4];
+    };
+
+    Vec4& normalize() {
+	simd = _mm_mul_ps(simd, rsqrt_nr_ps(dot_broadcast_ps(simd, simd)));
+
+	return *this;
+    }
+
+    float norm() const {
+	return sqrtf(*this * *this);
+    }
+
+    float operator[](int index) const {
+	assert(index >= 0 && index < 4);
+	return data[index];
+    }
+
+    float& operator[](int index) {
+	assert(index >= 0 && index < 4);
+	return data[index];
+    }
+
+    Vec4 operator-(const Vec4& b) const {
+	return Vec4(_mm_sub_ps(simd, b.simd));
+    }
+
+    Vec4 operator+(const Vec4& b) const {
+	return Vec4(_mm_add_ps(simd, b.simd));
+    }
+
+    float operator*(const Vec4& b) const {
+	return _mm_cvtss_f32(dot_broadcast_ps(simd, b.simd));
+    }
+
+    Vec4 operator*(const float& f) const {
+	return Vec4(_mm_mul_ps(simd, _mm_set1_ps(f)));
+    }
+
+    Vec4 operator/(const float& f) const {
+	return Vec4(_mm_div_ps(simd, _mm_set1_ps(f)));
+    }
+
+    Vec4 operator-() const {
+	return Vec4(_mm_xor_ps(simd, _mm_set1_ps(-0.0f)));
+    }
+};
+
+// The fourth lane is padding and is kept at zero so that four-lane dot
+// products and norms stay exact.
+template <>
+struct alignas(16) Vec3<float> {
+    Vec3() : simd(_mm_setzero_ps()) {}
+    Vec3(float x, float y, float z) : simd(_mm_setr_ps(x, y, z, 0.0f)) {}
+    explicit Vec3(__m128 v) : simd(v) {}
+
+    union {
+	__m128 simd;
+	struct {
+	    float x;
+	    float y;
+	    float z;
+	    float padding;
+	};
+	float data[4];
+    };
+
+    Vec3& normalize() {
+	simd = _mm_mul_ps(simd, rsqrt_nr_ps(dot_broadcast_ps(simd, simd)));
+
+	return *this;
+    }
+
+    float norm() const {
+	return sqrtf(*this * *this);
     }
 
-    float x;
-    float y;
+    // Index 0, 1 or 2: w is padding.
+    float operator[](int index) const {
+	assert(index >= 0 && index < 3);
+	return data[index];
+    }
+
+    float& operator[](int index) {
+	assert(index >= 0 && index < 3);
+	return data[index];
+    }
+
+    Vec3 operator-(const Vec3& b) const {
+	return Vec3(_mm_sub_ps(simd, b.simd));
+    }
+
+    Vec3 operator+(const Vec3& b) const {
+	return Vec3(_mm_add_ps(simd, b.simd));
+    }
+
+    float operator*(const Vec3& b) const {
+	return _mm_cvtss_f32(dot_broadcast_ps(simd, b.simd));
+    }
+
+    Vec3 operator*(const float& f) const {
+	return Vec3(_mm_mul_ps(simd, _mm_set1_ps(f)));
+    }
+
+    Vec3 operator/(const float& f) const {
+	return Vec3(_mm_div_ps(simd, _mm_set1_ps(f)));
+    }
+
+    Vec3 operator-() const {
+	return Vec3(_mm_xor_ps(simd, _mm_set1_ps(-0.0f)));
+    }
+};
+
+template <>
+inline Vec3f cross(const Vec3f& a, const Vec3f& b) {
+    __m128 a_yzx = _mm_shuffle_ps(a.simd, a.simd, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b.simd, b.simd, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a.simd, b_yzx), _mm_mul_ps(a_yzx, b.simd));
+
+    return Vec3f(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+template <>
+inline Vec3f component_min(const Vec3f& a, const Vec3f& b) {
+    return Vec3f(_mm_min_ps(a.simd, b.simd));
+}
+
+template <>
+inline Vec3f component_max(const Vec3f& a, const Vec3f& b) {
+    return Vec3f(_mm_max_ps(a.simd, b.simd));
+}
+
+template <>
+inline Vec3f component_mul(const Vec3f& a, const Vec3f& b) {
+    return Vec3f(_mm_mul_ps(a.simd, b.simd));
+}
 
-    Vec2f& normalize() {
-	float norm = sqrtf(x * x + y * y);
+// Two components do not fill a register, so Vec2 has no SIMD specialization.
+template <typename T>
+struct Vec2 {
+    constexpr Vec2() : Vec2(T(0), T(0)) {}
+    constexpr Vec2(T x, T y) : x(x), y(y) {}
+
+    union {
+	struct {
+	    T x;
+	    T y;
+	};
+	T data[2];
+    };
+
+    Vec2& normalize() {
+	T norm = std::sqrt(x * x + y * y);
 	x /= norm;
 	y /= norm;
 
 	return *this;
     }
 
-    float operator[](int index) {
-	switch(index) {
-	    case 0:
-		return x;
-	    case 1:
-		return y;
-	    default:
-		throw std::runtime_error("Invalid Index");
-	}
+    T operator[](int index) const {
+	assert(index >= 0 && index < 2);
+	return data[index];
+    }
+
+    T& operator[](int index) {
+	assert(index >= 0 && index < 2);
+	return data[index];
     }
 
-    Vec2f operator-(const Vec2f& b) const {
-	return Vec2f(this->x - b.x, this->y);
+    constexpr Vec2 operator-(const Vec2& b) const {
+	return Vec2(this->x - b.x, this->y - b.y);
     }
 
-    Vec2f operator+(const Vec2f& b) const {
-	return Vec2f(this->x + b.x, this->y);
+    constexpr Vec2 operator+(const Vec2& b) const {
+	return Vec2(this->x + b.x, this->y + b.y);
     }
 
-    float operator*(const Vec2f& b) const {
+    constexpr T operator*(const Vec2& b) const {
 	return this->x * b.x + this->y * b.y;
     }
 
-    Vec2f operator*(const float& f) const {
-	return Vec2f(x * f, y * f);
+    constexpr Vec2 operator*(const T& f) const {
+	return Vec2(x * f, y * f);
+    }
+
+    constexpr Vec2 operator/(const T& f) const {
+	return Vec2(x / f, y / f);
+    }
+};
+
+// Affine transform, stored as the top three rows of a 4x4 matrix.
+template <typename T>
+struct Transform {
+    Transform() : Transform(Vec4<T>(1, 0, 0, 0), Vec4<T>(0, 1, 0, 0), Vec4<T>(0, 0, 1, 0)) {}
+    Transform(const Vec4<T>& row0, const Vec4<T>& row1, const Vec4<T>& row2) {
+	rows[0] = row0;
+	rows[1] = row1;
+	rows[2] = row2;
+    }
+
+    Vec4<T> rows[3];
+
+    static Transform translation(const Vec3<T>& t) {
+	return Transform(Vec4<T>(1, 0, 0, t.x), Vec4<T>(0, 1, 0, t.y), Vec4<T>(0, 0, 1, t.z));
+    }
+
+    static Transform scaling(const T& s) {
+	return Transform(Vec4<T>(s, 0, 0, 0), Vec4<T>(0, s, 0, 0), Vec4<T>(0, 0, s, 0));
+    }
+
+    static Transform rotation_y(const T& angle) {
+	T c = std::cos(angle), s = std::sin(angle);
+	return Transform(Vec4<T>(c, 0, s, 0), Vec4<T>(0, 1, 0, 0), Vec4<T>(-s, 0, c, 0));
+    }
+
+    Vec3<T> transform_point(const Vec3<T>& p) const {
+	Vec4<T> h(p.x, p.y, p.z, 1);
+	return Vec3<T>(rows[0] * h, rows[1] * h, rows[2] * h);
+    }
+
+    Vec3<T> transform_vector(const Vec3<T>& v) const {
+	Vec4<T> h(v.x, v.y, v.z, 0);
+	return Vec3<T>(rows[0] * h, rows[1] * h, rows[2] * h);
+    }
+
+    // Multiplies by the transpose of the linear part. Normals are transformed
+    // this way by the inverse of the transform applied to the points.
+    Vec3<T> transform_normal(const Vec3<T>& n) const {
+	return Vec3<T>(rows[0].x * n.x + rows[1].x * n.y + rows[2].x * n.z,
+		       rows[0].y * n.x + rows[1].y * n.y + rows[2].y * n.z,
+		       rows[0].z * n.x + rows[1].z * n.y + rows[2].z * n.z);
+    }
+
+    // Applies b first, then this transform.
+    Transform operator*(const Transform& b) const {
+	Transform result;
+	for (int i = 0;i < 3;++i) {
+	    for (int j = 0;j < 4;++j) {
+		result.rows[i][j] = rows[i][0] * b.rows[0][j] + rows[i][1] * b.rows[1][j] + rows[i][2] * b.rows[2][j]
+		    + (j == 3 ? rows[i][3] : T(0));
+	    }
+	}
+	return result;
     }
 
-    Vec2f operator/(const float& f) const {
-	return Vec2f(x / f, y / f);
+    Transform inverse() const {
+	const Vec4<T>& a = rows[0];
+	const Vec4<T>& b = rows[1];
+	const Vec4<T>& c = rows[2];
+	T det = a.x * (b.y * c.z - b.z * c.y) - a.y * (b.x * c.z - b.z * c.x) + a.z * (b.x * c.y - b.y * c.x);
+	T inv_det = T(1) / det;
+
+	Transform result(Vec4<T>((b.y * c.z - b.z * c.y) * inv_det, (a.z * c.y - a.y * c.z) * inv_det, (a.y * b.z - a.z * b.y) * inv_det, 0),
+			 Vec4<T>((b.z * c.x - b.x * c.z) * inv_det, (a.x * c.z - a.z * c.x) * inv_det, (a.z * b.x - a.x * b.z) * inv_det, 0),
+			 Vec4<T>((b.x * c.y - b.y * c.x) * inv_det, (a.y * c.x - a.x * c.y) * inv_det, (a.x * b.y - a.y * b.x) * inv_det, 0));
+	Vec3<T> t = -result.transform_vector(Vec3<T>(a.w, b.w, c.w));
+	result.rows[0].w = t.x;
+	result.rows[1].w = t.y;
+	result.rows[2].w = t.z;
+	return result;
     }
 };
 
@@ -0,0 +1,194 @@
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+
+// Uniform grid over the scene bounds. Every cell lists the primitives whose
+// bounds overlap it, so a primitive may be referenced by several cells.
+// Building takes two linear passes, which is much cheaper than a BVH build
+// for dense and evenly spread primitives.
+template <typename T>
+struct UniformGrid {
+    // Target number of cells per primitive.
+    static constexpr double density = 2;
+    static const int max_resolution = 1024;
+
+    AABB<T> bounds;
+    int resolution[3] = {0, 0, 0};
+    Vec3<T> cell_size;
+    Vec3<T> inv_cell_size;
+    // Primitives of cell i are cell_primitives[cell_start[i]] up to
+    // cell_primitives[cell_start[i + 1]].
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> cell_primitives;
+
+    bool empty() const {
+	return cell_start.empty();
+    }
+
+    size_t cell_count() const {
+	return (size_t)resolution[0] * resolution[1] * resolution[2];
+    }
+
+    void build(const std::vector<AABB<T>>& primitive_bounds) {
+	bounds = AABB<T>();
+	cell_start.clear();
+	cell_primitives.clear();
+	if (primitive_bounds.empty()) return;
+
+	for (const auto& box : primitive_bounds) bounds.extend(box);
+
+	// Cubic cells sized for the target density. Flat axes are given some
+	// thickness so that the volume stays meaningful.
+	Vec3<T> extent = bounds.max - bounds.min;
+	T max_extent = std::max(std::max(extent.x, extent.y), extent.z);
+	double volume = 1;
+	for (int axis = 0;axis < 3;++axis) {
+	    volume *= std::max((double)extent[axis], 1e-3 * max_extent);
+	}
+	double cells_per_unit = std::cbrt(density * primitive_bounds.size() / std::max(volume, 1e-30));
+	for (int axis = 0;axis < 3;++axis) {
+	    resolution[axis] = std::max(1, std::min(max_resolution, (int)std::ceil(extent[axis] * cells_per_unit)));
+	    cell_size[axis] = std::max(extent[axis] / resolution[axis], std::numeric_limits<T>::min());
+	    inv_cell_size[axis] = T(1) / cell_size[axis];
+	}
+
+	// Counts the references of every cell, then fills them in place.
+	std::vector<uint32_t> counts(cell_count() + 1, 0);
+	for (const auto& box : primitive_bounds) {
+	    int lo[3], hi[3];
+	    cell_range(box, lo, hi);
+	    for (int z = lo[2];z <= hi[2];++z)
+		for (int y = lo[1];y <= hi[1];++y)
+		    for (int x = lo[0];x <= hi[0];++x)
+			++counts[cell_index(x, y, z)];
+	}
+	cell_start.resize(cell_count() + 1);
+	uint32_t offset = 0;
+	for (size_t i = 0;i < cell_start.size();++i) {
+	    cell_start[i] = offset;
+	    offset += counts[i];
+	}
+	cell_primitives.resize(offset);
+
+	std::copy(cell_start.begin(), cell_start.end() - 1, counts.begin());
+	for (uint32_t primitive = 0;primitive < primitive_bounds.size();++primitive) {
+	    int lo[3], hi[3];
+	    cell_range(primitive_bounds[primitive], lo, hi);
+	    for (int z = lo[2];z <= hi[2];++z)
+		for (int y = lo[1];y <= hi[1];++y)
+		    for (int x = lo[0];x <= hi[0];++x)
+			cell_primitives[counts[cell_index(x, y, z)]++] = primitive;
+	}
+    }
+
+    // Same contract as BVH::traverse. Cells are walked front to back with a
+    // 3D-DDA, stopping at the first cell that ends past the closest hit.
+    template <typename F>
+    bool traverse(const Vec3<T>& origin, const Vec3<T>& direction, T& t_max, F&& intersect) const {
+	if (empty()) return false;
+
+	// Avoids infinities, whose products with zero are not defined.
+	const T tiny = (T)1e-30;
+	Vec3<T> inv_direction;
+	for (int axis = 0;axis < 3;++axis) {
+	    T d = direction[axis];
+	    inv_direction[axis] = T(1) / (std::fabs(d) < tiny ? std::copysign(tiny, d) : d);
+	}
+
+	T t_entry;
+	if (!bounds.ray_intersect(origin, inv_direction, t_max, t_entry)) return false;
+
+	Vec3<T> entry = origin + direction * t_entry;
+	int cell[3], step[3];
+	T t_next[3], t_delta[3];
+	for (int axis = 0;axis < 3;++axis) {
+	    cell[axis] = std::max(0, std::min(resolution[axis] - 1, (int)((entry[axis] - bounds.min[axis]) * inv_cell_size[axis])));
+	    step[axis] = direction[axis] < 0 ? -1 : 1;
+	    T boundary = bounds.min[axis] + (cell[axis] + (step[axis] > 0)) * cell_size[axis];
+	    t_next[axis] = (boundary - origin[axis]) * inv_direction[axis];
+	    t_delta[axis] = cell_size[axis] * std::fabs(inv_direction[axis]);
+	}
+
+	bool hit = false;
+	while (true) {
+	    size_t index = cell_index(cell[0], cell[1], cell[2]);
+	    for (uint32_t i = cell_start[index];i < cell_start[index + 1];++i) {
+		hit |= intersect(cell_primitives[i], t_max);
+	    }
+
+	    int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+	    // Cells further along start past the closest hit.
+	    if (t_max <= t_next[axis]) break;
+	    cell[axis] += step[axis];
+	    if (cell[axis] < 0 || cell[axis] >= resolution[axis]) break;
+	    t_next[axis] += t_delta[axis];
+	}
+	return hit;
+    }
+
+    size_t memory_bytes() const {
+	return cell_start.capacity() * sizeof(uint32_t) + cell_primitives.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    size_t cell_index(int x, int y, int z) const {
+	return ((size_t)z * resolution[1] + y) * resolution[0] + x;
+    }
+
+    void cell_range(const AABB<T>& box, int lo[3], int hi[3]) const {
+	for (int axis = 0;axis < 3;++axis) {
+	    lo[axis] = std::max(0, std::min(resolution[axis] - 1, (int)((box.min[axis] - bounds.min[axis]) * inv_cell_size[axis])));
+	    hi[axis] = std::max(0, std::min(resolution[axis] - 1, (int)((box.max[axis] - bounds.min[axis]) * inv_cell_size[axis])));
+	}
+    }
+};
+
+// Scene statistics telling whether a uniform grid suits the primitives
+// better than a BVH: enough of them, of similar sizes and filling their
+// bounds evenly, so that cells are neither crowded nor mostly empty.
+template <typename T>
+bool grid_suits(const std::vector<AABB<T>>& primitive_bounds) {
+    const size_t min_primitives = 4096;
+    const T max_size_ratio = 4;
+    const int probe_resolution = 8;
+    const double max_empty_fraction = 0.1;
+
+    if (primitive_bounds.size() < min_primitives) return false;
+
+    AABB<T> bounds;
+    double mean_size = 0;
+    T max_size = 0;
+    for (const auto& box : primitive_bounds) {
+	bounds.extend(box);
+	T size = (box.max - box.min).norm();
+	mean_size += size;
+	max_size = std::max(max_size, size);
+    }
+    mean_size /= primitive_bounds.size();
+    if (max_size > max_size_ratio * mean_size) return false;
+
+    // Occupancy of a coarse grid of the primitive centers.
+    std::vector<char> occupied(probe_resolution * probe_resolution * probe_resolution, 0);
+    Vec3<T> extent = bounds.max - bounds.min;
+    for (const auto& box : primitive_bounds) {
+	Vec3<T> center = box.center();
+	int index = 0;
+	for (int axis = 2;axis >= 0;--axis) {
+	    int cell = extent[axis] > 0 ? (int)((center[axis] - bounds.min[axis]) / extent[axis] * probe_resolution) : 0;
+	    index = index * probe_resolution + std::max(0, std::min(probe_resolution - 1, cell));
+	}
+	occupied[index] = 1;
+    }
+    size_t empty_cells = std::count(occupied.begin(), occupied.end(), 0);
+    return empty_cells <= max_empty_fraction * occupied.size();
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef INSTANCE_HPP
+#define INSTANCE_HPP
+
+#include <cstdint>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+
+enum class InstanceGeometry {
+    Mesh,
+    SphereCluster
+};
+
+// A placed copy of a mesh or sphere cluster. Only the transform is stored per
+// instance, the geometry and its BVH are shared.
+template <typename T>
+struct Instance {
+    Instance(InstanceGeometry type, uint32_t geometry, const Transform<T>& object_to_world) :
+	type(type), geometry(geometry), object_to_world(object_to_world), world_to_object(object_to_world.inverse()) {}
+
+    InstanceGeometry type;
+    // Index in Scene::meshes or Scene::sphere_clusters, depending on type.
+    uint32_t geometry;
+    Transform<T> object_to_world;
+    Transform<T> world_to_object;
+};
+
+template <typename T>
+AABB<T> transform_bounds(const Transform<T>& transform, const AABB<T>& bounds) {
+    AABB<T> result;
+    if (bounds.empty()) return result;
+
+    for (int corner = 0;corner < 8;++corner) {
+	result.extend(transform.transform_point(Vec3<T>(corner & 1 ? bounds.max.x : bounds.min.x,
+							corner & 2 ? bounds.max.y : bounds.min.y,
+							corner & 4 ? bounds.max.z : bounds.min.z)));
+    }
+    return result;
+}
+
+#endif
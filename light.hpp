@@ -0,0 +1,244 @@
+#ifndef LIGHT_HPP
+#define LIGHT_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+#include "sampler.hpp"
+
+enum class LightType {
+    Point,
+    // Sphere of the given radius around the position.
+    Sphere,
+    // Spanned by two edges from the position.
+    Rectangle
+};
+
+template <typename T>
+struct Light {
+    Light(const Vec3<T>& position, const T& intensity) : type(LightType::Point), position(position), intensity(intensity) {}
+
+    static Light sphere(const Vec3<T>& center, const T& radius, const T& intensity, int samples) {
+	Light light(center, intensity);
+	light.type = LightType::Sphere;
+	light.radius = radius;
+	light.samples = samples;
+	return light;
+    }
+
+    static Light rectangle(const Vec3<T>& corner, const Vec3<T>& edge_u, const Vec3<T>& edge_v, const T& intensity, int samples) {
+	Light light(corner, intensity);
+	light.type = LightType::Rectangle;
+	light.edge_u = edge_u;
+	light.edge_v = edge_v;
+	light.samples = samples;
+	return light;
+    }
+
+    LightType type;
+    Vec3<T> position;
+    T intensity;
+    T radius = 0;
+    Vec3<T> edge_u;
+    Vec3<T> edge_v;
+    // Shadow rays budget of area lights at a shading point in penumbra.
+    int samples = 1;
+    // Distance past which the light has no effect; the intensity fades out
+    // smoothly before it. Infinite ranges do not fade.
+    T range = std::numeric_limits<T>::infinity();
+
+    bool is_area() const {
+	return type != LightType::Point;
+    }
+
+    T attenuation(T distance) const {
+	if (!(range < std::numeric_limits<T>::infinity())) return 1;
+	T x = distance / range;
+	T window = std::max(T(0), 1 - x * x * x * x);
+	return window * window;
+    }
+
+    AABB<T> bounds() const {
+	AABB<T> box;
+	switch (type) {
+	case LightType::Sphere:
+	    box.extend(position - Vec3<T>(radius, radius, radius));
+	    box.extend(position + Vec3<T>(radius, radius, radius));
+	    break;
+	case LightType::Rectangle:
+	    box.extend(position);
+	    box.extend(position + edge_u);
+	    box.extend(position + edge_v);
+	    box.extend(position + edge_u + edge_v);
+	    break;
+	default:
+	    box.extend(position);
+	}
+	return box;
+    }
+
+    // Point of the light for the sample (u, v) of the unit square. Spheres
+    // are sampled on the disk they show to the shading point.
+    Vec3<T> sample(const Vec3<T>& point, T u, T v) const {
+	switch (type) {
+	case LightType::Sphere: {
+	    Vec3<T> w = (position - point).normalize();
+	    Vec3<T> axis = std::fabs(w.x) < T(0.9) ? Vec3<T>(1, 0, 0) : Vec3<T>(0, 1, 0);
+	    Vec3<T> tangent = cross(axis, w).normalize();
+	    Vec3<T> bitangent = cross(w, tangent);
+	    T r = radius * std::sqrt(u);
+	    T phi = T(2 * M_PI) * v;
+	    return position + tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi));
+	}
+	case LightType::Rectangle:
+	    return position + edge_u * u + edge_v * v;
+	default:
+	    return position;
+	}
+    }
+};
+
+template <typename T>
+T squared_distance(const AABB<T>& box, const Vec3<T>& point) {
+    Vec3<T> d = component_max(component_max(box.min - point, point - box.max), Vec3<T>(0, 0, 0));
+    return d * d;
+}
+
+// BVH over the lights whose nodes also keep the total intensity and the
+// largest range of their lights. It finds the lights within range of a
+// point, or draws some of them with a probability following an estimate of
+// their contribution, both in about logarithmic time.
+template <typename T>
+struct LightTree {
+    static const uint32_t no_light = std::numeric_limits<uint32_t>::max();
+    static const int stack_size = BVH<T>::stack_size;
+
+    BVH<T> bvh;
+    std::vector<T> node_intensity;
+    std::vector<T> node_range;
+
+    bool empty() const {
+	return bvh.nodes.empty();
+    }
+
+    void build(const std::vector<Light<T>>& lights) {
+	std::vector<AABB<T>> bounds(lights.size());
+	for (size_t i = 0;i < lights.size();++i) {
+	    bounds[i] = lights[i].bounds();
+	}
+	bvh.build(bounds);
+
+	// Children follow their parent, so a reverse sweep sees them first.
+	node_intensity.assign(bvh.nodes.size(), 0);
+	node_range.assign(bvh.nodes.size(), 0);
+	for (size_t n = bvh.nodes.size();n-- > 0;) {
+	    const BVHNode<T>& node = bvh.nodes[n];
+	    if (node.is_leaf()) {
+		for (uint32_t i = node.first;i < node.first + node.count;++i) {
+		    const Light<T>& light = lights[bvh.indices[i]];
+		    node_intensity[n] += light.intensity;
+		    node_range[n] = std::max(node_range[n], light.range);
+		}
+	    } else {
+		node_intensity[n] = node_intensity[node.first] + node_intensity[node.first + 1];
+		node_range[n] = std::max(node_range[node.first], node_range[node.first + 1]);
+	    }
+	}
+    }
+
+    // Calls visit(light) for the lights whose range reaches point.
+    template <typename F>
+    void query(const std::vector<Light<T>>& lights, const Vec3<T>& point, F&& visit) const {
+	if (empty()) return;
+
+	uint32_t stack[stack_size];
+	int stack_top = 0;
+	stack[stack_top++] = 0;
+	while (stack_top > 0) {
+	    uint32_t n = stack[--stack_top];
+	    if (!in_range(n, point)) continue;
+
+	    const BVHNode<T>& node = bvh.nodes[n];
+	    if (node.is_leaf()) {
+		for (uint32_t i = node.first;i < node.first + node.count;++i) {
+		    uint32_t light = bvh.indices[i];
+		    if (squared_distance(lights[light].bounds(), point) <= lights[light].range * lights[light].range) visit(light);
+		}
+	    } else {
+		stack[stack_top++] = node.first + 1;
+		stack[stack_top++] = node.first;
+	    }
+	}
+    }
+
+    // Draws one light, descending the tree with a probability proportional
+    // to the importance of each child. Returns no_light if none reaches
+    // point, otherwise pdf receives the probability of the light drawn.
+    uint32_t select(const std::vector<Light<T>>& lights, const Vec3<T>& point, Sampler& sampler, T& pdf) const {
+	if (empty()) return no_light;
+
+	pdf = 1;
+	uint32_t n = 0;
+	if (importance(n, point) <= 0) return no_light;
+	while (!bvh.nodes[n].is_leaf()) {
+	    const BVHNode<T>& node = bvh.nodes[n];
+	    T left = importance(node.first, point);
+	    T right = importance(node.first + 1, point);
+	    if (left + right <= 0) return no_light;
+	    T p_left = left / (left + right);
+	    if (sampler.uniform<T>() < p_left) {
+		n = node.first;
+		pdf *= p_left;
+	    } else {
+		n = node.first + 1;
+		pdf *= 1 - p_left;
+	    }
+	}
+
+	const BVHNode<T>& leaf = bvh.nodes[n];
+	T weights[BVH<T>::max_leaf_size];
+	T total = 0;
+	for (uint32_t i = 0;i < leaf.count;++i) {
+	    const Light<T>& light = lights[bvh.indices[leaf.first + i]];
+	    weights[i] = estimate(light.intensity, light.range, light.bounds(), point);
+	    total += weights[i];
+	}
+	if (total <= 0) return no_light;
+
+	T u = sampler.uniform<T>() * total;
+	uint32_t i = 0;
+	while (i + 1 < leaf.count && (u -= weights[i]) >= 0) ++i;
+	while (weights[i] <= 0) --i;
+	pdf *= weights[i] / total;
+	return bvh.indices[leaf.first + i];
+    }
+
+    size_t memory_bytes() const {
+	return bvh.memory_bytes() + (node_intensity.capacity() + node_range.capacity()) * sizeof(T);
+    }
+
+private:
+    bool in_range(uint32_t n, const Vec3<T>& point) const {
+	return squared_distance(bvh.nodes[n].bounds, point) <= node_range[n] * node_range[n];
+    }
+
+    // Intensity over squared distance to the center of the bounds, the
+    // distance being kept above their half diagonal. Zero out of range.
+    static T estimate(T intensity, T range, const AABB<T>& bounds, const Vec3<T>& point) {
+	if (squared_distance(bounds, point) > range * range) return 0;
+	Vec3<T> to_center = bounds.center() - point;
+	Vec3<T> half_diagonal = (bounds.max - bounds.min) * T(0.5);
+	return intensity / std::max(to_center * to_center, std::max(half_diagonal * half_diagonal, T(1e-4)));
+    }
+
+    T importance(uint32_t n, const Vec3<T>& point) const {
+	return estimate(node_intensity[n], node_range[n], bvh.nodes[n].bounds, point);
+    }
+};
+
+#endif
@@ -1,277 +1,292 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
-#include <limits>
+#include <string>
 #include <vector>
-#include <fstream>
-#include <cmath>
 #include <omp.h>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
 #include "geometry.hpp"
-
-struct Material {
-    Material(const float& refraction_index, const Vec4f& albedo, const Vec3f& color, const float& specular) :
-	albedo(albedo), diffuse_color(color), specular_exponent(specular), refraction_index(refraction_index) {}
-    Material() : albedo(1, 0, 0, 0), diffuse_color(), specular_exponent() {}
-    Vec3f diffuse_color;
-    Vec4f albedo;
-    float specular_exponent;
-    float refraction_index;
-};
-
-struct Light {
-    Light(const Vec3f& position, const float& intensity) : position(position), intensity(intensity) {}
-    Vec3f position;
-    float intensity;
-};
-
-struct Sphere {
-    Vec3f center;
-    float radius;
-    Material material;
-
-    Sphere(const Vec3f& c, const float& r, const Material& m) : center(c), radius(r), material(m) {}
-
-    bool ray_intersect(const Vec3f& origin, const Vec3f& direction, float& t0) const {
-	Vec3f L = center - origin;
-	float tca = L * direction;
-	float d2 = L * L - tca * tca;
-	if (d2 > radius * radius) return false;
-	float thc = sqrtf(radius * radius - d2);
-	t0 = tca - thc;
-	float t1 = tca + thc;
-	if (t0 < 0) t0 = t1;
-	if (t0 < 0) return false;
-	return true;
+#include "scene.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "envmap.hpp"
+#include "envmap_cache.hpp"
+#include "render.hpp"
+#include "baked_scene.hpp"
+
+// Adds the mesh with one instance in place, plus copies - 1 more laid out on a
+// grid behind it, each turned around its center.
+template <typename T>
+bool add_obj(Scene<T>& scene, const char* path, int copies) {
+    Mesh<T> mesh;
+    mesh.material = Material<T>(1.0, Vec4<T>(0.6, 0.3, 0.1, 0.0), Vec3<T>(0.4, 0.4, 0.3), 50);
+
+    auto start = std::chrono::steady_clock::now();
+    if (!load_obj(path, mesh)) {
+	return false;
     }
-};
-
-struct Envmap {
-  int width;
-  int height;
-  int channels;
-
-  unsigned char* pixels;
-};
-
-Envmap make_envmap(int width, int height, int channels, unsigned char* pixels) {
-    Envmap envmap;
-
-    envmap.width = width;
-    envmap.height = height;
-    envmap.channels = channels;
-    envmap.pixels = pixels;
-
-    return envmap;
-}
-
-void free_envmap(Envmap& envmap) {
-    stbi_image_free(envmap.pixels);
-}
-
-float clampf(float value, float min, float max) {
-    if (value > max) return max;
-    if (value < min) return min;
-    return value;
-}
-
-int clamp(int value, int min, int max) {
-    if (value > max) return max;
-    if (value < min) return min;
-    return value;
-}
-
-Vec3f sample_envmap(Envmap& envmap, Vec3f direction) {
-    float yaw = 0.0f;
-
-    Vec2f xz_direction(direction.x, direction.z);
-    xz_direction.normalize();
-
-    Vec2f forward(0.0f, -1.0f);
-
-    float dot_xz = xz_direction * forward;
-    float det_xz = xz_direction.x * forward.y - xz_direction.y * forward.x;
-
-    float angle = atan2(det_xz, dot_xz);
-
-    Vec3f up(0.0f, 1.0f, 0.0f);
-    Vec3f up_normal = cross(direction, up);
-
-    float dot_up = direction * up;
-    float det_up = direction.x * up.y * up_normal.z
-	+ up.x * up_normal.y * direction.z
-	- direction.z * up.y * up_normal.x
-	- up.z * up_normal.y * direction.x
-	- up_normal.z * direction.y * up.x;
-
-    float vertical_angle = atan2(det_up, dot_up);
-
-    float x = ((angle / M_PI) + 1.0f) / 2.0f * (float)envmap.width;
-    float y = (vertical_angle / M_PI) * (float)envmap.height;
-    if (isnan(angle)) {
-	x = 0;
+    auto loaded = std::chrono::steady_clock::now();
+    mesh.build_bvh();
+    auto built = std::chrono::steady_clock::now();
+
+    std::cout << path << ": " << mesh.triangle_count() << " triangles, "
+	      << "loaded in " << std::chrono::duration<double, std::milli>(loaded - start).count() << " ms, "
+	      << "BVH built in " << std::chrono::duration<double, std::milli>(built - loaded).count() << " ms, "
+	      << "SAH cost " << mesh.bvh.sah_cost() << ", "
+	      << (double)mesh.memory_bytes() / std::max<size_t>(1, mesh.triangle_count()) << " bytes/triangle" << std::endl;
+
+    AABB<T> bounds = mesh.bounds();
+    Vec3<T> center = bounds.center();
+    T spacing = (bounds.max - bounds.min).norm();
+    int columns = (int)std::ceil(std::sqrt((double)copies));
+    uint32_t geometry = (uint32_t)scene.meshes.size();
+    for (int i = 0;i < copies;++i) {
+	Vec3<T> offset(spacing * (i % columns - columns / 2), 0, -spacing * (i / columns));
+	Transform<T> transform = Transform<T>::translation(center + offset) * Transform<T>::rotation_y(i * 0.7)
+	    * Transform<T>::translation(-center);
+	scene.instances.push_back(Instance<T>(InstanceGeometry::Mesh, geometry, transform));
     }
 
-    int x_int = clamp((int)x, 0, envmap.width - 1);
-    int y_int = clamp((int)y, 0, envmap.height - 1);
-
-    int pixel_index = (y_int * envmap.width + x_int) * 3;
-
-    float r = (float)*(envmap.pixels + pixel_index) / 255.0f;
-    float g = (float)*(envmap.pixels + pixel_index + 1) / 255.0f;
-    float b = (float)*(envmap.pixels + pixel_index + 2) / 255.0f;
-
-    return Vec3f(r, g, b);
+    scene.meshes.push_back(std::move(mesh));
+    return true;
 }
 
-Vec3f reflect(const Vec3f& incident, const Vec3f& N) {
-    return incident - N * 2.0f * (incident * N);
-}
-
-Vec3f refract(const Vec3f& incident, const Vec3f& N, const float& refractive_index) {
-    float cosi = -std::max(-1.f, std::min(1.f, incident * N));
-    float etai = 1, etat = refractive_index;
-
-    Vec3f n = N;
-    if (cosi < 0) {
-	cosi = -cosi;
-	std::swap(etai, etat);
-	n = -N;
-    }
+struct Options {
+    bool double_precision = false;
+    const char* envmap_path = "../resources/envmap.jpg";
+    // Directory of the decoded envmap cache, null to decode every run.
+    const char* envmap_cache_dir = nullptr;
+    // Budget of the tile cache of the envmap, shared by all threads, in MiB;
+    // 0 to load it whole.
+    int envmap_tile_mib = 0;
+    int environment_samples = 0;
+    std::vector<const char*> obj_paths;
+    int copies = 1;
+    int trees = 0;
+    int frames = 1;
+    int samples = 1;
+    // Area lights and their sample budget, 0 for point lights.
+    int light_samples = 0;
+    bool adaptive_shadows = true;
+    bool tile_culling = true;
+    bool raster_prepass = false;
+    int rig_lights = 0;
+    int light_selection = 0;
+    bool wavefront = false;
+    bool fast_math = false;
+    Accelerator accelerator = Accelerator::BVH;
+    FramebufferFormat framebuffer_format = FramebufferFormat::Full;
+};
 
-    float eta = etai / etat;
-    float k = 1 - eta * eta * (1 - cosi * cosi);
-    return k < 0 ? Vec3f(0, 0, 0) : incident * eta + n * (eta * cosi - sqrtf(k));
-}
+template <typename T>
+int run(Envmap& envmap, const Options& options) {
+    const int width{1920 * 1};
+    const int height{1080 * 1};
 
-bool scene_intersect(const Vec3f& origin, const Vec3f& direction, const std::vector<Sphere>& spheres, Vec3f& hit, Vec3f& N, Material& material) {
-    float sphere_dist = std::numeric_limits<float>::max();
-    for (const auto& sphere : spheres) {
-	float dist;
-	if (sphere.ray_intersect(origin, direction, dist) && dist < sphere_dist) {
-	    sphere_dist = dist;
-	    hit = origin + direction * dist;
-	    N = (hit - sphere.center).normalize();
-	    material = sphere.material;
+    Scene<T> scene;
+#ifdef BAKED_SCENE
+    make_baked_scene<DefaultBakedScene>(scene);
+#else
+    make_default_scene(scene);
+#endif
+    if (options.light_samples > 0) make_area_lights(scene, T(6), options.light_samples);
+    for (const char* path : options.obj_paths) {
+	if (!add_obj(scene, path, options.copies)) {
+	    return -1;
 	}
     }
-
-    float checkerboard_distance = std::numeric_limits<float>::max();
-    if (fabs(direction.y) > 1e-3) {
-      float d = -(origin.y + 4) / direction.y;
-
-      Vec3f pt = origin + direction * d;
-
-      if (d > 0 && fabs(pt.x) < 20 && pt.z < -10 && pt.z > -50 && d < sphere_dist) {
-	checkerboard_distance = d;
-	hit = pt;
-	N = Vec3f(0, 1, 0);
-	material.diffuse_color = (((int)(0.5 * hit.x + 1000) + (int)(0.5 * hit.z)) & 1 ? Vec3f(1, 1, 1) : Vec3f(1, .3, .7)) * 0.3;
-      }
+    add_forest(scene, options.trees);
+    add_light_rig(scene, options.rig_lights);
+    scene.build_light_tree();
+    if (!scene.light_tree.empty()) {
+	std::cout << scene.lights.size() << " lights, light tree of " << scene.light_tree.bvh.nodes.size() << " nodes" << std::endl;
     }
 
-    return std::min(sphere_dist, checkerboard_distance) < 1000;
-}
-
-Vec3f cast_ray(const Vec3f& origin, const Vec3f& direction, const std::vector<Sphere>& spheres, const std::vector<Light>& lights, Envmap& envmap, size_t depth = 0) {
-    Vec3f point, N;
-    Material material;
-
-    if (depth > 6 || !scene_intersect(origin, direction, spheres, point, N, material)) {
-	return sample_envmap(envmap, direction);
+    scene.accelerator = options.accelerator;
+    auto start = std::chrono::steady_clock::now();
+    scene.build_accelerator();
+    auto built = std::chrono::steady_clock::now();
+    if (scene.baked_intersect) {
+	std::cout << scene.bounded_primitive_count() << " primitives, baked at compile time" << std::endl;
+    } else if (scene.accelerator == Accelerator::Grid) {
+	std::cout << scene.bounded_primitive_count() << " primitives, grid built in " << std::chrono::duration<double, std::milli>(built - start).count()
+		  << " ms, " << scene.primitive_grid.resolution[0] << "x" << scene.primitive_grid.resolution[1] << "x" << scene.primitive_grid.resolution[2]
+		  << " cells, " << (double)scene.primitive_grid.memory_bytes() / std::max<size_t>(1, scene.bounded_primitive_count()) << " bytes/primitive" << std::endl;
+    } else {
+	std::cout << scene.bounded_primitive_count() << " primitives, BVH built in " << std::chrono::duration<double, std::milli>(built - start).count()
+		  << " ms on " << omp_get_max_threads() << " threads, " << scene.primitive_bvh.bvh.nodes.size() << " nodes, "
+		  << "SAH cost " << scene.primitive_bvh.sah_cost() << std::endl;
+    }
+    if (scene.accelerator == Accelerator::WideBVH) {
+	std::cout << "wide BVH: " << scene.wide_primitive_bvh.nodes.size() << " nodes, "
+		  << (double)scene.wide_primitive_bvh.memory_bytes() / std::max<size_t>(1, scene.bounded_primitive_count()) << " bytes/primitive" << std::endl;
     }
 
-    Vec3f reflect_direction = reflect(direction, N).normalize();
-    Vec3f reflect_origin = reflect_direction * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-    Vec3f reflect_color = cast_ray(reflect_origin, reflect_direction, spheres, lights, envmap, depth + 1);
-
-    Vec3f refract_direction = refract(direction, N, material.refraction_index).normalize();
-    Vec3f refract_origin = refract_direction * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-    Vec3f refract_color = cast_ray(refract_origin, refract_direction, spheres, lights, envmap, depth + 1);
-
-    float diffuse_light_intensity = 0, specular_light_intensity = 0;
-    for (const auto& light : lights) {
-	Vec3f light_direction = (light.position - point).normalize();
-	float light_distance = (light.position - point).norm();
+    if (!scene.instances.empty()) {
+	auto start = std::chrono::steady_clock::now();
+	scene.build_instance_bvh();
+	auto built = std::chrono::steady_clock::now();
 
-	Vec3f shadow_origin = light_direction * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-	Vec3f shadow_point, shadow_n;
-	Material temp_material;
-	if (scene_intersect(shadow_origin, light_direction, spheres, shadow_point, shadow_n, temp_material) && (shadow_point - shadow_origin).norm() < light_distance) {
-	    continue;
+	size_t geometry_bytes = 0, flattened_bytes = 0;
+	for (const auto& instance : scene.instances) {
+	    size_t bytes = instance.type == InstanceGeometry::Mesh ? scene.meshes[instance.geometry].memory_bytes() : scene.sphere_clusters[instance.geometry].memory_bytes();
+	    flattened_bytes += bytes;
 	}
-
-	diffuse_light_intensity += light.intensity * std::max(0.f, light_direction * N);
-	specular_light_intensity += powf(std::max(0.0f, -reflect(-light_direction, N) * direction), material.specular_exponent) * light.intensity;
+	for (const auto& mesh : scene.meshes) geometry_bytes += mesh.memory_bytes();
+	for (const auto& cluster : scene.sphere_clusters) geometry_bytes += cluster.memory_bytes();
+	size_t instance_bytes = scene.instances.capacity() * sizeof(Instance<T>) + scene.instance_bvh.memory_bytes();
+
+	std::cout << scene.instances.size() << " instances of " << scene.meshes.size() + scene.sphere_clusters.size() << " objects, "
+		  << "top level BVH built in " << std::chrono::duration<double, std::milli>(built - start).count() << " ms, "
+		  << "SAH cost " << scene.instance_bvh.sah_cost() << ", "
+		  << (geometry_bytes + instance_bytes) / 1024 << " KiB (" << flattened_bytes / 1024 << " KiB flattened)" << std::endl;
     }
 
-    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] +
-						  Vec3f(1.0, 1.0, 1.0) * specular_light_intensity * material.albedo[1] +
-						  reflect_color * material.albedo[2] +
-						  refract_color * material.albedo[3];
-}
-
-void render(const std::vector<Sphere>& spheres, const std::vector<Light>& lights, Envmap& envmap) {
-    const int width{1920 * 1};
-    const int height{1080 * 1};
-    const double fov{70.0};
-    std::vector<Vec3f> framebuffer(width * height);
+    Vec3<T> color = sample_envmap(envmap, Vec3<T>(0.0, 0.0, -1.0));
+    std::cout << "r: " << color.x << "g: " << color.y << "b: " << color.z << std::endl;
 
-    size_t i, j;
-    #pragma omp parallel for private(i), private(j)
-    for (j = 0;j < height;++j) {
-	for (i = 0;i < width;++i) {
-	    float x = (2 * (i + 0.5) / (float)width - 1) * tan(fov/2.) * width / (float)height;
-	    float y = -(2 * (j + 0.5) / (float)height - 1) * tan(fov/2.);
-	    Vec3f dir = Vec3f(x, y, -1).normalize();
-	    framebuffer[j * width + i] = cast_ray(Vec3f(0, 0, 0), dir, spheres, lights, envmap);
+    Framebuffer<T> framebuffer(options.framebuffer_format);
+    for (int frame = 0;frame < options.frames;++frame) {
+	if (frame > 0) {
+	    // The glass sphere drifts to the right.
+	    std::vector<SphereTransform<T>> motion{{1, Transform<T>::translation(Vec3<T>(0.4, 0, 0))}};
+	    auto start = std::chrono::steady_clock::now();
+	    bool rebuilt = scene.move_spheres(motion);
+	    auto updated = std::chrono::steady_clock::now();
+	    if (scene.accelerator == Accelerator::Grid) {
+		std::cout << "frame " << frame << ": grid rebuilt in "
+			  << std::chrono::duration<double, std::milli>(updated - start).count() << " ms" << std::endl;
+	    } else {
+		std::cout << "frame " << frame << ": BVH " << (rebuilt ? "rebuilt" : "refitted") << " in "
+			  << std::chrono::duration<double, std::milli>(updated - start).count() << " ms, "
+			  << "SAH cost " << scene.primitive_bvh.sah_cost() << std::endl;
+	    }
 	}
-    }
 
-    std::ofstream ofs;
-    ofs.open("./out.ppm");
-    ofs << "P6\n" << width << " " << height << "\n255\n";
-
-    for (size_t i{0};i < width * height;++i) {
-	for (size_t j{0};j < 3;++j) {
-	    Vec3f& c = framebuffer[i];
-	    float max = std::max(c[0], std::max(c[1], c[2]));
-	    if (max > 1) c = c * (1. / max);
-	    ofs << (char)(255 * std::max(0.0f, std::min(1.f, framebuffer[i][j])));
+	RenderSettings settings;
+	settings.samples = options.samples;
+	settings.adaptive_shadows = options.adaptive_shadows;
+	settings.light_selection = options.light_selection;
+	settings.wavefront = options.wavefront;
+	settings.fast_math = options.fast_math;
+	settings.tile_culling = options.tile_culling;
+	settings.raster_prepass = options.raster_prepass;
+	settings.environment_samples = options.environment_samples;
+	RenderStats stats = render(framebuffer, width, height, scene, envmap, settings);
+	if (frame == 0) {
+	    std::cout << "framebuffer: " << framebuffer.pixel_bytes() << " bytes/pixel, " << framebuffer.memory_bytes() / 1024 << " KiB" << std::endl;
+	}
+	std::cout << stats.shadow_rays << " shadow rays, occluder cache hit rate " << 100 * stats.occluder_cache_hit_rate() << "%" << std::endl;
+	if (settings.tile_culling) {
+	    std::cout << stats.envmap_tiles << " of " << stats.tiles << " tiles culled to the envmap" << std::endl;
 	}
+	if (envmap.tiles) {
+	    std::cout << envmap.tiles->reads << " envmap tiles read of " << envmap.tiles->tile_count << ", up to "
+		      << envmap.tiles->capacity << " resident" << std::endl;
+	}
+	std::string path = options.frames == 1 ? "./out.ppm" : "./out_" + std::to_string(frame) + ".ppm";
+	write_ppm(path.c_str(), framebuffer);
     }
-    ofs.close();
+    return 0;
 }
 
-int main(int, char**) {
-    Material ivory(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.4f, 0.4f, 0.3f), 50);
-    Material glass(1.05, Vec4f(0.1, 0.9, 0.1, 0.8), Vec3f(0.9f, 0.1f, 0.1f), 1205);
-    Material red_rubber(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.3f, 0.1f, 0.1f), 10);
-    Material mirror(1.0, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.f, 1.0f, 1.f), 1425);
-
-    std::vector<Sphere> spheres;
-    spheres.push_back(Sphere(Vec3f(-3, 0, -16), 2, ivory));
-    spheres.push_back(Sphere(Vec3f(-1.0, -1.5, -12), 2, glass));
-    spheres.push_back(Sphere(Vec3f(1.5, -0.5, -18), 3, red_rubber));
-    spheres.push_back(Sphere(Vec3f(7, 5, -18), 4, mirror));
-
-    std::vector<Light> lights;
-    lights.push_back(Light(Vec3f(-20, 20,  20), 1.5));
-    lights.push_back(Light(Vec3f( 30, 50, -25), 1.8));
-    lights.push_back(Light(Vec3f( 30, 20,  30), 1.7));
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1;i < argc;++i) {
+	std::string arg(argv[i]);
+	if (arg == "--double") {
+	    options.double_precision = true;
+	} else if (arg == "--obj" && i + 1 < argc) {
+	    options.obj_paths.push_back(argv[++i]);
+	} else if (arg == "--copies" && i + 1 < argc) {
+	    options.copies = std::max(1, atoi(argv[++i]));
+	} else if (arg == "--forest" && i + 1 < argc) {
+	    options.trees = atoi(argv[++i]);
+	} else if (arg == "--frames" && i + 1 < argc) {
+	    options.frames = std::max(1, atoi(argv[++i]));
+	} else if (arg == "--samples" && i + 1 < argc) {
+	    options.samples = std::max(1, atoi(argv[++i]));
+	} else if (arg == "--area-lights" && i + 1 < argc) {
+	    options.light_samples = std::max(1, atoi(argv[++i]));
+	} else if (arg == "--no-adaptive-shadows") {
+	    options.adaptive_shadows = false;
+	} else if (arg == "--no-tile-culling") {
+	    options.tile_culling = false;
+	} else if (arg == "--raster-prepass") {
+	    options.raster_prepass = true;
+	} else if (arg == "--light-rig" && i + 1 < argc) {
+	    options.rig_lights = atoi(argv[++i]);
+	} else if (arg == "--light-selection" && i + 1 < argc) {
+	    options.light_selection = std::max(0, atoi(argv[++i]));
+	} else if (arg == "--envmap" && i + 1 < argc) {
+	    options.envmap_path = argv[++i];
+	} else if (arg == "--envmap-cache" && i + 1 < argc) {
+	    options.envmap_cache_dir = argv[++i];
+	} else if (arg == "--no-envmap-cache") {
+	    options.envmap_cache_dir = nullptr;
+	} else if (arg == "--envmap-tiles" && i + 1 < argc) {
+	    options.envmap_tile_mib = std::max(1, atoi(argv[++i]));
+	} else if (arg == "--environment-samples" && i + 1 < argc) {
+	    options.environment_samples = std::max(0, atoi(argv[++i]));
+	} else if (arg == "--wavefront") {
+	    options.wavefront = true;
+	} else if (arg == "--fast-math") {
+	    options.fast_math = true;
+	} else if (arg == "--accel" && i + 1 < argc && std::string(argv[i + 1]) == "bvh") {
+	    options.accelerator = Accelerator::BVH;
+	    ++i;
+	} else if (arg == "--accel" && i + 1 < argc && std::string(argv[i + 1]) == "wide") {
+	    options.accelerator = Accelerator::WideBVH;
+	    ++i;
+	} else if (arg == "--accel" && i + 1 < argc && std::string(argv[i + 1]) == "grid") {
+	    options.accelerator = Accelerator::Grid;
+	    ++i;
+	} else if (arg == "--accel" && i + 1 < argc && std::string(argv[i + 1]) == "auto") {
+	    options.accelerator = Accelerator::Auto;
+	    ++i;
+	} else if (arg == "--framebuffer" && i + 1 < argc && std::string(argv[i + 1]) == "full") {
+	    options.framebuffer_format = FramebufferFormat::Full;
+	    ++i;
+	} else if (arg == "--framebuffer" && i + 1 < argc && std::string(argv[i + 1]) == "half") {
+	    options.framebuffer_format = FramebufferFormat::Half;
+	    ++i;
+	} else if (arg == "--framebuffer" && i + 1 < argc && std::string(argv[i + 1]) == "rgbe") {
+	    options.framebuffer_format = FramebufferFormat::RGBE;
+	    ++i;
+	} else {
+	    std::cerr << "usage: " << argv[0] << " [--double] [--obj file.obj]... [--copies n] [--forest n] [--frames n] [--samples n] [--area-lights n] [--no-adaptive-shadows] [--no-tile-culling] [--raster-prepass] [--light-rig n] [--light-selection k] [--envmap file] [--envmap-cache dir] [--no-envmap-cache] [--envmap-tiles MiB] [--environment-samples n] [--wavefront] [--fast-math] [--accel bvh|wide|grid|auto] [--framebuffer full|half|rgbe]" << std::endl;
+	    return -1;
+	}
+    }
+#ifdef BAKED_SCENE
+    if (options.frames > 1) {
+	std::cerr << "--frames moves the spheres, which this build bakes into its code" << std::endl;
+	return -1;
+    }
+#endif
 
     Envmap envmap = {};
-    envmap.pixels = stbi_load("../resources/envmap.jpg", &envmap.width, &envmap.height, &envmap.channels, 0);
-
-    if (envmap.pixels == 0) {
+    auto start = std::chrono::steady_clock::now();
+    bool loaded_envmap;
+    if (options.envmap_tile_mib > 0) {
+	const char* tile_dir = options.envmap_cache_dir ? options.envmap_cache_dir : ".";
+	loaded_envmap = load_envmap_tiled(options.envmap_path, envmap, tile_dir, (size_t)options.envmap_tile_mib << 20);
+    } else if (options.envmap_cache_dir) {
+	loaded_envmap = load_envmap_cached(options.envmap_path, envmap, options.envmap_cache_dir);
+    } else {
+	loaded_envmap = load_envmap(options.envmap_path, envmap);
+    }
+    if (!loaded_envmap) {
+      std::cerr << "cannot load " << options.envmap_path << std::endl;
       return -1;
     }
+    auto loaded = std::chrono::steady_clock::now();
+    std::cout << options.envmap_path << ": " << envmap.width << "x" << envmap.height << (envmap.hdr ? " HDR" : "") << ", "
+	      << envmap.mips.size() << " mip levels, " << (envmap.tiles ? "read by tiles" : envmap.mapping ? "mapped from the cache" : "decoded") << " in "
+	      << std::chrono::duration<double, std::milli>(loaded - start).count() << " ms" << std::endl;
 
-    Vec3f color = sample_envmap(envmap, Vec3f(0.0, 0.0, -1.0));
-    std::cout << "r: " << color.x << "g: " << color.y << "b: " << color.z << std::endl;
+    int result = options.double_precision ? run<double>(envmap, options) : run<float>(envmap, options);
 
-    render(spheres, lights, envmap);
     free_envmap(envmap);
-    return 0;
+    return result;
 }
@@ -0,0 +1,107 @@
+#ifndef MATERIAL_HPP
+#define MATERIAL_HPP
+
+#include <cmath>
+
+#include "geometry.hpp"
+
+enum class TextureType {
+    Constant,
+    // Squares alternating between the two colors.
+    Checker,
+    // Bands alternating along the first texture coordinate.
+    Stripes
+};
+
+// Procedural pattern over the texture coordinates of a surface, mixing the
+// diffuse color of the material with a second one.
+template <typename T>
+struct Texture {
+    Texture() : type(TextureType::Constant), color(), frequency(1) {}
+    Texture(TextureType type, const Vec3<T>& color, const T& frequency) : type(type), color(color), frequency(frequency) {}
+    TextureType type;
+    Vec3<T> color;
+    // Pattern periods per unit of texture coordinate.
+    T frequency;
+
+    Vec3<T> evaluate(const Vec3<T>& diffuse_color, const Vec2<T>& uv) const {
+	long u = (long)std::floor(uv.x * frequency);
+	long v = (long)std::floor(uv.y * frequency);
+	switch (type) {
+	case TextureType::Checker:
+	    return (u + v) & 1 ? color : diffuse_color;
+	case TextureType::Stripes:
+	    return u & 1 ? color : diffuse_color;
+	default:
+	    return diffuse_color;
+	}
+    }
+};
+
+// Terms of the shading model a material weighs, shading kernels being
+// specialized on them so that the others are compiled out.
+enum class MaterialClass {
+    // Diffuse light only.
+    Diffuse,
+    // Diffuse and specular light.
+    Glossy,
+    // Diffuse and specular light, and reflection.
+    Polished,
+    // Specular light and reflection.
+    Mirror,
+    // Every term, refraction included; also taken by the materials that
+    // fit no other class.
+    Dielectric
+};
+
+constexpr bool has_diffuse(MaterialClass type) {
+    return type != MaterialClass::Mirror;
+}
+
+constexpr bool has_specular(MaterialClass type) {
+    return type != MaterialClass::Diffuse;
+}
+
+constexpr bool has_reflection(MaterialClass type) {
+    return type == MaterialClass::Polished || type == MaterialClass::Mirror || type == MaterialClass::Dielectric;
+}
+
+constexpr bool has_refraction(MaterialClass type) {
+    return type == MaterialClass::Dielectric;
+}
+
+// Narrowest class with a term for every nonzero weight of albedo.
+template <typename T>
+MaterialClass classify_material(const Vec4<T>& albedo) {
+    if (albedo[3] != 0) return MaterialClass::Dielectric;
+    if (albedo[0] == 0) return MaterialClass::Mirror;
+    if (albedo[2] != 0) return MaterialClass::Polished;
+    return albedo[1] == 0 ? MaterialClass::Diffuse : MaterialClass::Glossy;
+}
+
+// The albedo weighs the diffuse, specular, reflected and refracted light.
+// It is only set when the material is made, its class following from it.
+template <typename T>
+struct Material {
+    Material(const T& refraction_index, const Vec4<T>& albedo, const Vec3<T>& color, const T& specular) :
+	diffuse_color(color), specular_exponent(specular), refraction_index(refraction_index), weights(albedo), material_class(classify_material(albedo)) {}
+    Material() : diffuse_color(), specular_exponent(), weights(1, 0, 0, 0), material_class(MaterialClass::Diffuse) {}
+    Vec3<T> diffuse_color;
+    T specular_exponent;
+    T refraction_index;
+    Texture<T> texture;
+
+    const Vec4<T>& albedo() const {
+	return weights;
+    }
+
+    MaterialClass type() const {
+	return material_class;
+    }
+
+private:
+    Vec4<T> weights;
+    MaterialClass material_class;
+};
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+#include "material.hpp"
+#include "bvh.hpp"
+
+// Per-ray setup of the watertight ray/triangle test of Woop, Benthin and Wald
+// (2013). The ray is sheared to point along +z so that triangles can be
+// tested in 2D with edge functions, and a ray can never slip between two
+// triangles sharing an edge.
+template <typename T>
+struct WatertightRay {
+    WatertightRay(const Vec3<T>& origin, const Vec3<T>& direction) : origin(origin) {
+	T ax = std::fabs(direction.x), ay = std::fabs(direction.y), az = std::fabs(direction.z);
+	kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	if (direction[kz] < 0) std::swap(kx, ky);
+
+	Sx = direction[kx] / direction[kz];
+	Sy = direction[ky] / direction[kz];
+	Sz = T(1) / direction[kz];
+    }
+
+    Vec3<T> origin;
+    int kx, ky, kz;
+    T Sx, Sy, Sz;
+
+    // On a hit closer than t, t is updated and true is returned.
+    bool intersect(const Vec3<T>& v0, const Vec3<T>& v1, const Vec3<T>& v2, T& t) const {
+	const Vec3<T> A = v0 - origin;
+	const Vec3<T> B = v1 - origin;
+	const Vec3<T> C = v2 - origin;
+
+	const T Ax = A[kx] - Sx * A[kz];
+	const T Ay = A[ky] - Sy * A[kz];
+	const T Bx = B[kx] - Sx * B[kz];
+	const T By = B[ky] - Sy * B[kz];
+	const T Cx = C[kx] - Sx * C[kz];
+	const T Cy = C[ky] - Sy * C[kz];
+
+	T U = Cx * By - Cy * Bx;
+	T V = Ax * Cy - Ay * Cx;
+	T W = Bx * Ay - By * Ax;
+
+	// Edge cases are resolved in double precision.
+	if (sizeof(T) < sizeof(double) && (U == 0 || V == 0 || W == 0)) {
+	    U = (T)((double)Cx * By - (double)Cy * Bx);
+	    V = (T)((double)Ax * Cy - (double)Ay * Cx);
+	    W = (T)((double)Bx * Ay - (double)By * Ax);
+	}
+
+	if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+
+	T det = U + V + W;
+	if (det == 0) return false;
+
+	const T Az = Sz * A[kz];
+	const T Bz = Sz * B[kz];
+	const T Cz = Sz * C[kz];
+	const T scaled_t = U * Az + V * Bz + W * Cz;
+
+	if (det < 0 ? (scaled_t >= 0 || scaled_t < t * det) : (scaled_t <= 0 || scaled_t > t * det)) return false;
+
+	t = scaled_t / det;
+	return true;
+    }
+};
+
+// Indexed triangle mesh with its own BVH. Positions are stored packed, without
+// the SIMD padding of Vec3, to keep the memory per triangle low.
+template <typename T>
+struct Mesh {
+    std::vector<T> positions;
+    // Three vertex indices per triangle.
+    std::vector<uint32_t> triangles;
+    Material<T> material;
+    BVH<T> bvh;
+
+    size_t vertex_count() const {
+	return positions.size() / 3;
+    }
+
+    size_t triangle_count() const {
+	return triangles.size() / 3;
+    }
+
+    Vec3<T> vertex(uint32_t index) const {
+	return Vec3<T>(positions[3 * index], positions[3 * index + 1], positions[3 * index + 2]);
+    }
+
+    AABB<T> triangle_bounds(uint32_t triangle) const {
+	AABB<T> bounds;
+	for (int i = 0;i < 3;++i) {
+	    bounds.extend(vertex(triangles[3 * triangle + i]));
+	}
+	return bounds;
+    }
+
+    AABB<T> bounds() const {
+	return bvh.nodes.empty() ? AABB<T>() : bvh.nodes[0].bounds;
+    }
+
+    void build_bvh() {
+	std::vector<AABB<T>> primitive_bounds(triangle_count());
+	for (uint32_t i = 0;i < primitive_bounds.size();++i) {
+	    primitive_bounds[i] = triangle_bounds(i);
+	}
+	bvh.build(primitive_bounds);
+    }
+
+    // t holds the distance of the closest hit found so far and is updated,
+    // along with the geometric normal N, when a closer triangle is hit.
+    bool ray_intersect(const Vec3<T>& origin, const Vec3<T>& direction, T& t, Vec3<T>& N) const {
+	WatertightRay<T> ray(origin, direction);
+	uint32_t hit_triangle = 0;
+	bool hit = bvh.traverse(origin, direction, t, [&](uint32_t triangle, T& t_max) {
+	    const uint32_t* v = &triangles[3 * triangle];
+	    if (ray.intersect(vertex(v[0]), vertex(v[1]), vertex(v[2]), t_max)) {
+		hit_triangle = triangle;
+		return true;
+	    }
+	    return false;
+	});
+
+	if (hit) {
+	    const uint32_t* v = &triangles[3 * hit_triangle];
+	    Vec3<T> v0 = vertex(v[0]);
+	    N = cross(vertex(v[1]) - v0, vertex(v[2]) - v0).normalize();
+	}
+	return hit;
+    }
+
+    size_t memory_bytes() const {
+	return positions.capacity() * sizeof(T) + triangles.capacity() * sizeof(uint32_t) + bvh.memory_bytes();
+    }
+};
+
+inline bool obj_is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+inline bool obj_is_line_end(char c) {
+    return c == '\n' || c == '\r';
+}
+
+// Loads the vertices and faces of a Wavefront OBJ file into mesh; polygons
+// are fan triangulated and every other statement is ignored. The BVH is not
+// built. Returns false if the file cannot be read or is malformed.
+template <typename T>
+bool load_obj(const char* path, Mesh<T>& mesh) {
+    // A directory may open and report a bogus size, but then reads nothing:
+    // peek before allocating.
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::streamoff size = file ? (std::streamoff)file.tellg() : -1;
+    file.seekg(0);
+    if (size < 0 || !file || (size > 0 && file.peek() == std::ifstream::traits_type::eof())) {
+	std::cerr << path << ": cannot open file" << std::endl;
+	return false;
+    }
+    std::string data((size_t)size, '\0');
+    file.read(&data[0], data.size());
+    if (!file) {
+	std::cerr << path << ": cannot open file" << std::endl;
+	return false;
+    }
+
+    mesh.positions.clear();
+    mesh.triangles.clear();
+
+    const char* p = data.data();
+    const char* end = p + data.size();
+    size_t line = 1;
+    std::vector<uint32_t> polygon;
+    while (p < end) {
+	while (p < end && obj_is_space(*p)) ++p;
+
+	if (end - p > 1 && p[0] == 'v' && obj_is_space(p[1])) {
+	    p += 2;
+	    for (int i = 0;i < 3;++i) {
+		while (p < end && obj_is_space(*p)) ++p;
+		T value;
+		std::from_chars_result result = std::from_chars(p, end, value);
+		if (result.ec != std::errc()) {
+		    std::cerr << path << ":" << line << ": invalid vertex" << std::endl;
+		    return false;
+		}
+		mesh.positions.push_back(value);
+		p = result.ptr;
+	    }
+	} else if (end - p > 1 && p[0] == 'f' && obj_is_space(p[1])) {
+	    p += 2;
+	    polygon.clear();
+	    const long vertex_count = (long)mesh.vertex_count();
+	    while (true) {
+		while (p < end && obj_is_space(*p)) ++p;
+		if (p == end || obj_is_line_end(*p)) break;
+
+		long index;
+		std::from_chars_result result = std::from_chars(p, end, index);
+		if (result.ec != std::errc()) {
+		    std::cerr << path << ":" << line << ": invalid face" << std::endl;
+		    return false;
+		}
+		index = index < 0 ? vertex_count + index : index - 1;
+		if (index < 0 || index >= vertex_count) {
+		    std::cerr << path << ":" << line << ": vertex index out of range" << std::endl;
+		    return false;
+		}
+		polygon.push_back((uint32_t)index);
+
+		// Texture coordinate and normal indices are skipped.
+		p = result.ptr;
+		while (p < end && !obj_is_space(*p) && !obj_is_line_end(*p)) ++p;
+	    }
+
+	    for (size_t i = 2;i < polygon.size();++i) {
+		mesh.triangles.push_back(polygon[0]);
+		mesh.triangles.push_back(polygon[i - 1]);
+		mesh.triangles.push_back(polygon[i]);
+	    }
+	}
+
+	while (p < end && *p != '\n') ++p;
+	++p;
+	++line;
+    }
+
+    mesh.positions.shrink_to_fit();
+    mesh.triangles.shrink_to_fit();
+    return true;
+}
+
+#endif
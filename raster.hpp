@@ -0,0 +1,196 @@
+#ifndef RASTER_HPP
+#define RASTER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "geometry.hpp"
+#include "arena.hpp"
+#include "bvh.hpp"
+#include "scene.hpp"
+
+// Primary visibility by rasterization. The bounded primitives of a scene are
+// projected through the pinhole camera of render() at the origin, looking
+// down -z, to the rectangles of pixels covering their boxes, and binned by
+// tile. A tile then walks its bin and tests the primary ray of every pixel
+// of a rectangle against that primitive alone, keeping the nearest hit in
+// an ID and depth buffer. Primitives are tested in increasing order with
+// the strict comparison of Scene::intersect_primitives(), so the hits are
+// those of testing every primitive in turn.
+
+// Half-open rectangle of pixels, and a lower bound of the distance at which
+// rays hit the primitive it covers.
+struct PixelRect {
+    int x0, y0, x1, y1;
+    double near;
+
+    bool empty() const {
+	return x0 >= x1 || y0 >= y1;
+    }
+};
+
+// Margin added around projections against rounding, in pixels. The pixel
+// rays of samples are jittered across the whole pixel.
+const double raster_margin = 0.5;
+
+// Rectangle of the pixels whose rays cross the screen within [x_min, x_max]
+// x [y_min, y_max], in pixel units.
+inline PixelRect pixel_rect(double x_min, double y_min, double x_max, double y_max, double near, int width, int height) {
+    // Clamped as doubles first, far off screen bounds overflowing ints.
+    auto clamp = [](double v, int limit) { return (int)std::max(0.0, std::min((double)limit, v)); };
+    return PixelRect{clamp(std::floor(x_min - raster_margin), width), clamp(std::floor(y_min - raster_margin), height),
+		     clamp(std::floor(x_max + raster_margin) + 1, width), clamp(std::floor(y_max + raster_margin) + 1, height), near};
+}
+
+// Pixels whose primary rays may hit a box: those of its projected corners.
+// Boxes reaching behind the camera cover the whole image, those entirely
+// behind it none.
+template <typename T>
+PixelRect project_box(const AABB<T>& box, int width, int height, double tan_half_fov) {
+    if (box.min.z >= 0) return PixelRect{0, 0, 0, 0, 0};
+    if (box.max.z >= 0) return PixelRect{0, 0, width, height, 0};
+    double x_min = width, x_max = 0, y_min = height, y_max = 0;
+    for (int k = 0;k < 8;++k) {
+	double x = k & 1 ? box.max.x : box.min.x;
+	double y = k & 2 ? box.max.y : box.min.y;
+	double z = k & 4 ? box.max.z : box.min.z;
+	// Inverse of the pixel to direction mapping of render().
+	double px = (x / -z / (tan_half_fov * width / height) + 1) * width / 2;
+	double py = (1 - y / -z / tan_half_fov) * height / 2;
+	x_min = std::min(x_min, px);
+	x_max = std::max(x_max, px);
+	y_min = std::min(y_min, py);
+	y_max = std::max(y_max, py);
+    }
+    // Distance to the closest point of the box.
+    double dx = std::max(0.0, std::max((double)box.min.x, -(double)box.max.x));
+    double dy = std::max(0.0, std::max((double)box.min.y, -(double)box.max.y));
+    double dz = -(double)box.max.z;
+    return pixel_rect(x_min, y_min, x_max, y_max, std::sqrt(dx * dx + dy * dy + dz * dz), width, height);
+}
+
+// Tighter than the box of a sphere in front of the camera: the tangents to
+// the sphere from the camera in the planes of the screen axes bound its
+// outline exactly.
+template <typename T>
+PixelRect project_sphere(const Vec3<T>& center, T radius, int width, int height, double tan_half_fov) {
+    double d = -(double)center.z, r = radius;
+    if (d <= r) {
+	Vec3<T> extent(radius, radius, radius);
+	return project_box(AABB<T>(center - extent, center + extent), width, height, tan_half_fov);
+    }
+    // Screen coordinates of the tangents to the circle of radius r around
+    // (c, d) from the origin, c being the coordinate along the axis: both
+    // at infinity if the circle holds the origin, one at infinity if the
+    // other goes past the side of the camera.
+    auto tangents = [&](double c, double& low, double& high) {
+	double t2 = c * c + d * d - r * r;
+	double t = std::sqrt(std::max(0.0, t2));
+	double low_denominator = d * t + c * r, high_denominator = d * t - c * r;
+	const double infinity = std::numeric_limits<double>::infinity();
+	low = low_denominator > 0 ? (c * t - r * d) / low_denominator : -infinity;
+	high = high_denominator > 0 ? (c * t + r * d) / high_denominator : infinity;
+    };
+    double x_low, x_high, y_low, y_high;
+    tangents(center.x, x_low, x_high);
+    tangents(center.y, y_low, y_high);
+    double x_scale = width / (2 * tan_half_fov * width / height), y_scale = height / (2 * tan_half_fov);
+    double near = std::max(0.0, std::sqrt((double)(center * center)) - r);
+    return pixel_rect((x_low + tan_half_fov * width / height) * x_scale, (tan_half_fov - y_high) * y_scale,
+		      (x_high + tan_half_fov * width / height) * x_scale, (tan_half_fov - y_low) * y_scale, near, width, height);
+}
+
+// Bounded primitives binned by the tiles their pixel rectangles overlap.
+// Everything lives in the arena it was built in.
+struct RasterBins {
+    int tile_size = 0;
+    int tiles_x = 0;
+    PixelRect* rects = nullptr;
+    // Primitives of tile t, in increasing order: primitives[offsets[t]] to
+    // primitives[offsets[t + 1]].
+    uint32_t* offsets = nullptr;
+    uint32_t* primitives = nullptr;
+};
+
+template <typename T>
+RasterBins bin_primitives(const Scene<T>& scene, int width, int height, double tan_half_fov, int tile_size, Arena& arena) {
+    RasterBins bins;
+    bins.tile_size = tile_size;
+    bins.tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    const uint32_t count = (uint32_t)scene.bounded_primitive_count();
+    bins.rects = arena.allocate_array<PixelRect>(count);
+    bins.offsets = arena.allocate_array<uint32_t>((size_t)bins.tiles_x * tiles_y + 1);
+
+    #pragma omp parallel for if (count >= 4096)
+    for (uint32_t i = 0;i < count;++i) {
+	bins.rects[i] = i < scene.spheres.size() ? project_sphere(scene.spheres[i].center, scene.spheres[i].radius, width, height, tan_half_fov)
+						 : project_box(scene.primitive_bounds(i), width, height, tan_half_fov);
+    }
+    // Counts, then their prefix sums, then the bins themselves.
+    auto for_each_tile = [&](const PixelRect& rect, auto&& f) {
+	if (rect.empty()) return;
+	for (int ty = rect.y0 / tile_size;ty <= (rect.y1 - 1) / tile_size;++ty) {
+	    for (int tx = rect.x0 / tile_size;tx <= (rect.x1 - 1) / tile_size;++tx) {
+		f(ty * bins.tiles_x + tx);
+	    }
+	}
+    };
+    for (uint32_t i = 0;i < count;++i) {
+	for_each_tile(bins.rects[i], [&](int tile) { ++bins.offsets[tile + 1]; });
+    }
+    for (int tile = 0;tile < bins.tiles_x * tiles_y;++tile) {
+	bins.offsets[tile + 1] += bins.offsets[tile];
+    }
+    bins.primitives = arena.allocate_array<uint32_t>(bins.offsets[bins.tiles_x * tiles_y]);
+    uint32_t* fill = arena.allocate_array<uint32_t>((size_t)bins.tiles_x * tiles_y);
+    for (uint32_t i = 0;i < count;++i) {
+	for_each_tile(bins.rects[i], [&](int tile) { bins.primitives[bins.offsets[tile] + fill[tile]++] = i; });
+    }
+    return bins;
+}
+
+// Nearest primitive hit by the primary ray of every pixel of the tile
+// [x0, x1) x [y0, y1), whose directions are given row by row, and its
+// distance: no_primitive and the largest distance if none. Planes are
+// tested at every pixel, after the bounded primitives.
+template <typename T>
+void rasterize_tile(const Scene<T>& scene, const RasterBins& bins, int x0, int y0, int x1, int y1, const Vec3<T>* directions,
+		    uint32_t* primitives, T* depths) {
+    const int tile_width = x1 - x0;
+    const int tile = y0 / bins.tile_size * bins.tiles_x + x0 / bins.tile_size;
+    const Vec3<T> origin(0, 0, 0);
+    std::fill(primitives, primitives + tile_width * (y1 - y0), Scene<T>::no_primitive);
+    std::fill(depths, depths + tile_width * (y1 - y0), std::numeric_limits<T>::max());
+    // Primitives no closer than the hit of a pixel are not tested there,
+    // the bound being lowered against rounding.
+    auto test = [&](uint32_t primitive, int i, int j, double near) {
+	int pixel = (j - y0) * tile_width + i - x0;
+	T dist;
+	if (near * (1 - 1e-4) >= depths[pixel]) return;
+	if (scene.primitive_intersect(primitive, origin, directions[pixel], dist) && dist < depths[pixel]) {
+	    depths[pixel] = dist;
+	    primitives[pixel] = primitive;
+	}
+    };
+    for (uint32_t k = bins.offsets[tile];k < bins.offsets[tile + 1];++k) {
+	uint32_t primitive = bins.primitives[k];
+	const PixelRect& rect = bins.rects[primitive];
+	for (int j = std::max(y0, rect.y0);j < std::min(y1, rect.y1);++j) {
+	    for (int i = std::max(x0, rect.x0);i < std::min(x1, rect.x1);++i) {
+		test(primitive, i, j, rect.near);
+	    }
+	}
+    }
+    for (uint32_t p = 0;p < scene.planes.size();++p) {
+	for (int j = y0;j < y1;++j) {
+	    for (int i = x0;i < x1;++i) {
+		test((uint32_t)scene.bounded_primitive_count() + p, i, j, 0);
+	    }
+	}
+    }
+}
+
+#endif
@@ -0,0 +1,735 @@
+#ifndef RENDER_HPP
+#define RENDER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <new>
+#include <vector>
+
+#include "geometry.hpp"
+#include "scene.hpp"
+#include "raster.hpp"
+#include "envmap.hpp"
+#include "fast_math.hpp"
+#include "arena.hpp"
+#include "framebuffer.hpp"
+#include "sampler.hpp"
+
+// Offset along the normal used to spawn secondary rays without hitting the
+// surface they start from. Double precision can afford a much smaller one.
+template <typename T> constexpr T ray_epsilon();
+template <> constexpr float ray_epsilon<float>() { return 1e-3f; }
+template <> constexpr double ray_epsilon<double>() { return 1e-7; }
+
+template <typename T>
+Vec3<T> reflect(const Vec3<T>& incident, const Vec3<T>& N) {
+    return incident - N * T(2) * (incident * N);
+}
+
+template <typename T>
+Vec3<T> refract(const Vec3<T>& incident, const Vec3<T>& N, const T& refractive_index) {
+    T cosi = -std::max(T(-1), std::min(T(1), incident * N));
+    T etai = 1, etat = refractive_index;
+
+    Vec3<T> n = N;
+    if (cosi < 0) {
+	cosi = -cosi;
+	std::swap(etai, etat);
+	n = -N;
+    }
+
+    T eta = etai / etat;
+    T k = 1 - eta * eta * (1 - cosi * cosi);
+    return k < 0 ? Vec3<T>(0, 0, 0) : incident * eta + n * (eta * cosi - std::sqrt(k));
+}
+
+// Surface hit by a ray, given the nearest primitive it hits at distance
+// nearest_dist, or no_primitive and the largest distance: instances that
+// are closer still take precedence. curvature receives that of the surface
+// hit, see Scene::primitive_curvature().
+template <typename T>
+bool resolve_hit(const Vec3<T>& origin, const Vec3<T>& direction, const Scene<T>& scene, uint32_t primitive, T nearest_dist,
+		 Vec3<T>& hit, Vec3<T>& N, Material<T>& material, T& curvature) {
+    const Material<T>* hit_material = nullptr;
+    Vec2<T> uv;
+    if (primitive != Scene<T>::no_primitive) {
+	hit = origin + direction * nearest_dist;
+	scene.primitive_surface(primitive, hit, N, uv, hit_material);
+	curvature = scene.primitive_curvature(primitive);
+    }
+
+    // Instanced geometry has no texture coordinates and is taken as flat.
+    if (scene.intersect_instances(origin, direction, nearest_dist, N, hit_material)) {
+	hit = origin + direction * nearest_dist;
+	uv = Vec2<T>();
+	curvature = 0;
+    }
+
+    if (!hit_material) return false;
+    material = *hit_material;
+    material.diffuse_color = material.texture.evaluate(material.diffuse_color, uv);
+    return nearest_dist < 1000;
+}
+
+template <typename T>
+bool scene_intersect(const Vec3<T>& origin, const Vec3<T>& direction, const Scene<T>& scene, Vec3<T>& hit, Vec3<T>& N, Material<T>& material, T& curvature) {
+    T nearest_dist = std::numeric_limits<T>::max();
+    uint32_t primitive = scene.intersect_primitives(origin, direction, nearest_dist);
+    return resolve_hit(origin, direction, scene, primitive, nearest_dist, hit, N, material, curvature);
+}
+
+// Cone of rays around a ray (Akenine-Moller et al. 2019), given by its
+// width at the origin of the ray and the angle it spreads by. Environment
+// lookups are filtered over the spread, which curved surfaces widen. Both
+// reflected and refracted cones spread as if reflected by a convex mirror.
+template <typename T>
+struct RayCone {
+    T width;
+    T spread;
+
+    RayCone bounce(T distance, T curvature) const {
+	T hit_width = width + spread * distance;
+	return RayCone{hit_width, spread + 2 * hit_width * curvature};
+    }
+};
+
+// Samples taken by a render. Renders can be accumulated: a framebuffer that
+// holds the mean of first_sample samples per pixel receives samples more.
+struct RenderSettings {
+    int samples = 1;
+    int first_sample = 0;
+    uint32_t seed = 0;
+    // Spends the sample budget of area lights only in penumbra.
+    bool adaptive_shadows = true;
+    // Lights drawn from the light tree at every shading point, 0 to shade
+    // all the lights within range.
+    int light_selection = 0;
+    // Tests the last occluder of each light before tracing shadow rays.
+    bool occluder_cache = true;
+    // Traces the rays of a tile breadth first instead of one pixel at a time.
+    bool wavefront = false;
+    // Directions drawn from the envmap at every shading point to light it,
+    // 0 to leave the envmap to the rays that escape the scene.
+    int environment_samples = 0;
+    // Approximates pow, atan2 and 1/sqrt in shading and envmap lookups (see
+    // fast_math.hpp).
+    bool fast_math = false;
+    // Shades every material with the kernel of its class rather than the
+    // general one.
+    bool material_kernels = true;
+    // Shades the tiles whose primary rays cannot hit the scene from the
+    // envmap alone, without tracing them.
+    bool tile_culling = true;
+    // Finds the primary hits of the recursive integrator by rasterizing the
+    // primitives into per-tile ID and depth buffers (see raster.hpp)
+    // instead of tracing them.
+    bool raster_prepass = false;
+};
+
+// Counters of a render, summed over its threads.
+struct RenderStats {
+    size_t shadow_rays = 0;
+    // Shadow rays found blocked by the cached occluder of their light.
+    size_t occluder_cache_hits = 0;
+    size_t tiles = 0;
+    // Tiles culled to the envmap.
+    size_t envmap_tiles = 0;
+
+    double occluder_cache_hit_rate() const {
+	return shadow_rays > 0 ? (double)occluder_cache_hits / shadow_rays : 0;
+    }
+
+    double envmap_tile_rate() const {
+	return tiles > 0 ? (double)envmap_tiles / tiles : 0;
+    }
+};
+
+// Last primitive found blocking each light, kept per thread for the tile
+// being rendered: neighbouring pixels are usually shadowed by the same
+// primitive, which is cheaper to test alone than to find again through the
+// scene. The envmap has the slot after the lights. Instances are not cached.
+struct ShadowCache {
+    uint32_t* occluders = nullptr;
+    size_t shadow_rays = 0;
+    size_t hits = 0;
+};
+
+// Shadow rays first cast at an area light, on a 2x2 grid of strata. The
+// rest of its budget is only spent when they disagree.
+const int penumbra_probes = 4;
+
+// Whether something lies between point and target on the light. Without a
+// cache, occluders is null.
+template <typename T>
+bool occluded(const Vec3<T>& point, const Vec3<T>& N, const Vec3<T>& target, const Scene<T>& scene, ShadowCache& cache, uint32_t light) {
+    const T epsilon = ray_epsilon<T>();
+    Vec3<T> light_direction = (target - point).normalize();
+    T light_distance = (target - point).norm();
+
+    Vec3<T> shadow_origin = light_direction * N < 0 ? point - N * epsilon : point + N * epsilon;
+    // Hits past the scene horizon do not count, as in scene_intersect().
+    T max_distance = std::min(light_distance, T(1000));
+    ++cache.shadow_rays;
+    uint32_t* occluder = cache.occluders ? &cache.occluders[light] : nullptr;
+    T dist;
+    if (occluder && *occluder != Scene<T>::no_primitive && scene.primitive_intersect(*occluder, shadow_origin, light_direction, dist) && dist < max_distance) {
+	++cache.hits;
+	return true;
+    }
+
+    T nearest_dist = std::numeric_limits<T>::max();
+    uint32_t primitive = scene.intersect_primitives(shadow_origin, light_direction, nearest_dist);
+    Vec3<T> shadow_n;
+    const Material<T>* shadow_material = nullptr;
+    bool instance = scene.intersect_instances(shadow_origin, light_direction, nearest_dist, shadow_n, shadow_material);
+    if (!(nearest_dist < max_distance)) return false;
+    if (occluder && !instance) *occluder = primitive;
+    return true;
+}
+
+// Calls visit(light, weight) for the lights shading point: all of them,
+// those the light tree finds in range, or light_selection of them drawn from
+// it and weighted by their probability.
+template <typename T, typename F>
+void visit_lights(const Scene<T>& scene, const RenderSettings& settings, const Vec3<T>& point, Sampler& sampler, F&& visit) {
+    if (scene.light_tree.empty()) {
+	for (uint32_t light = 0;light < scene.lights.size();++light) {
+	    visit(light, T(1));
+	}
+    } else if (settings.light_selection > 0) {
+	for (int k = 0;k < settings.light_selection;++k) {
+	    T pdf;
+	    uint32_t light = scene.light_tree.select(scene.lights, point, sampler, pdf);
+	    if (light != LightTree<T>::no_light) visit(light, T(1) / (settings.light_selection * pdf));
+	}
+    } else {
+	scene.light_tree.query(scene.lights, point, [&](uint32_t light) { visit(light, T(1)); });
+    }
+}
+
+// Direction from point to target, with their distance, through fast_rsqrt()
+// in fast math mode.
+template <typename T>
+Vec3<T> direction_to(const Vec3<T>& point, const Vec3<T>& target, bool fast_math, T& distance) {
+    Vec3<T> offset = target - point;
+    if (!fast_math) {
+	distance = offset.norm();
+	return offset.normalize();
+    }
+    T squared = offset * offset;
+    T inverse = T(fast_rsqrt((float)squared));
+    distance = squared * inverse;
+    return offset * inverse;
+}
+
+// Shadow rays towards the envmap end this far away.
+const double environment_distance = 2000;
+
+// Diffuse light from the envmap at point, estimated from directions drawn
+// following its distribution. The specular part is left to reflected rays.
+template <typename T>
+Vec3<T> environment_lighting(const Vec3<T>& point, const Vec3<T>& N, const Scene<T>& scene, const Envmap& envmap, const RenderSettings& settings, Sampler& sampler, ShadowCache& shadow_cache) {
+    Vec3<T> sum(0, 0, 0);
+    for (int k = 0;k < settings.environment_samples;++k) {
+	T pdf;
+	T u1 = sampler.uniform<T>(), u2 = sampler.uniform<T>();
+	Vec3<T> direction = sample_envmap_direction(envmap, u1, u2, pdf);
+	T cosine = direction * N;
+	if (cosine <= 0 || !(pdf > 0)) continue;
+	if (occluded(point, N, point + direction * T(environment_distance), scene, shadow_cache, (uint32_t)scene.lights.size())) continue;
+	sum = sum + sample_envmap(envmap, direction, T(0), settings.fast_math) * (cosine / (T(M_PI) * pdf));
+    }
+    return sum / T(settings.environment_samples);
+}
+
+template <typename T>
+Vec3<T> cast_ray(const Vec3<T>& origin, const Vec3<T>& direction, const RayCone<T>& cone, const Scene<T>& scene, const Envmap& envmap, const RenderSettings& settings, Sampler& sampler, ShadowCache& shadow_cache, size_t depth = 0);
+
+// Light leaving point towards the origin of direction, on a material of
+// class C: the terms it has no weight for are compiled out, with the rays
+// and the shadow samples they would take. Every kernel, the general one
+// included, also skips the reflected and refracted rays of zero weight. The
+// environment samples of classes without a diffuse term are skipped and
+// draw no random numbers, so the noise of environment sampling differs from
+// that of the general kernel.
+template <MaterialClass C, typename T>
+Vec3<T> shade(const Vec3<T>& point, const Vec3<T>& N, const Material<T>& material, const Vec3<T>& direction, const RayCone<T>& bounced, const Scene<T>& scene, const Envmap& envmap, const RenderSettings& settings, Sampler& sampler, ShadowCache& shadow_cache, size_t depth) {
+    const T epsilon = ray_epsilon<T>();
+    Vec3<T> reflect_color(0, 0, 0), refract_color(0, 0, 0);
+    if (has_reflection(C) && material.albedo()[2] != 0) {
+	Vec3<T> reflect_direction = reflect(direction, N).normalize();
+	Vec3<T> reflect_origin = reflect_direction * N < 0 ? point - N * epsilon : point + N * epsilon;
+	reflect_color = cast_ray(reflect_origin, reflect_direction, bounced, scene, envmap, settings, sampler, shadow_cache, depth + 1);
+    }
+    if (has_refraction(C) && material.albedo()[3] != 0) {
+	Vec3<T> refract_direction = refract(direction, N, material.refraction_index).normalize();
+	Vec3<T> refract_origin = refract_direction * N < 0 ? point - N * epsilon : point + N * epsilon;
+	refract_color = cast_ray(refract_origin, refract_direction, bounced, scene, envmap, settings, sampler, shadow_cache, depth + 1);
+    }
+
+    T diffuse_light_intensity = 0, specular_light_intensity = 0;
+    // Adds the contribution of a light, scaled by weight.
+    auto shade_light = [&](uint32_t index, T weight) {
+	const Light<T>& light = scene.lights[index];
+	T diffuse = 0, specular = 0;
+	int visible = 0, count = 0;
+	auto add_sample = [&](const Vec3<T>& target) {
+	    ++count;
+	    T distance;
+	    Vec3<T> light_direction = direction_to(point, target, settings.fast_math, distance);
+	    T intensity = light.intensity * light.attenuation(distance);
+	    if (intensity <= 0 || occluded(point, N, target, scene, shadow_cache, index)) return;
+	    if constexpr (has_diffuse(C)) diffuse += intensity * std::max(T(0), light_direction * N);
+	    if constexpr (has_specular(C)) specular += shading_pow(std::max(T(0), -reflect(-light_direction, N) * direction), material.specular_exponent, settings.fast_math) * intensity;
+	    ++visible;
+	};
+	// At least n samples, jittered on a square grid of strata.
+	auto add_stratified = [&](int n) {
+	    int side = (int)std::ceil(std::sqrt((T)n));
+	    for (int k = 0;k < side * side;++k) {
+		T u = (k % side + sampler.uniform<T>()) / side;
+		T v = (k / side + sampler.uniform<T>()) / side;
+		add_sample(light.sample(point, u, v));
+	    }
+	};
+
+	if (!light.is_area()) {
+	    add_sample(light.position);
+	} else if (!settings.adaptive_shadows || light.samples <= penumbra_probes) {
+	    add_stratified(light.samples);
+	} else {
+	    add_stratified(penumbra_probes);
+	    if (visible > 0 && visible < count) add_stratified(light.samples);
+	}
+	diffuse_light_intensity += weight * diffuse / count;
+	specular_light_intensity += weight * specular / count;
+    };
+
+    visit_lights(scene, settings, point, sampler, shade_light);
+    Vec3<T> color(0, 0, 0);
+    if constexpr (has_diffuse(C)) {
+	color = color + material.diffuse_color * diffuse_light_intensity * material.albedo()[0];
+	if (settings.environment_samples > 0 && !envmap.distribution.empty()) {
+	    Vec3<T> environment = environment_lighting(point, N, scene, envmap, settings, sampler, shadow_cache);
+	    color = color + component_mul(material.diffuse_color, environment) * material.albedo()[0];
+	}
+    }
+    if constexpr (has_specular(C)) color = color + Vec3<T>(1.0, 1.0, 1.0) * specular_light_intensity * material.albedo()[1];
+    if constexpr (has_reflection(C)) color = color + reflect_color * material.albedo()[2];
+    if constexpr (has_refraction(C)) color = color + refract_color * material.albedo()[3];
+    return color;
+}
+
+// cast_ray() past the intersection of the primitives, given the nearest
+// primitive hit at distance nearest_dist as by Scene::intersect_primitives().
+template <typename T>
+Vec3<T> cast_ray_from_hit(const Vec3<T>& origin, const Vec3<T>& direction, const RayCone<T>& cone, uint32_t primitive, T nearest_dist, const Scene<T>& scene, const Envmap& envmap, const RenderSettings& settings, Sampler& sampler, ShadowCache& shadow_cache, size_t depth) {
+    Vec3<T> point, N;
+    Material<T> material;
+    T curvature;
+
+    if (!resolve_hit(origin, direction, scene, primitive, nearest_dist, point, N, material, curvature)) {
+	return sample_envmap(envmap, direction, cone.spread, settings.fast_math);
+    }
+    RayCone<T> bounced = cone.bounce((point - origin).norm(), curvature);
+
+    switch (settings.material_kernels ? material.type() : MaterialClass::Dielectric) {
+    case MaterialClass::Diffuse:
+	return shade<MaterialClass::Diffuse>(point, N, material, direction, bounced, scene, envmap, settings, sampler, shadow_cache, depth);
+    case MaterialClass::Glossy:
+	return shade<MaterialClass::Glossy>(point, N, material, direction, bounced, scene, envmap, settings, sampler, shadow_cache, depth);
+    case MaterialClass::Polished:
+	return shade<MaterialClass::Polished>(point, N, material, direction, bounced, scene, envmap, settings, sampler, shadow_cache, depth);
+    case MaterialClass::Mirror:
+	return shade<MaterialClass::Mirror>(point, N, material, direction, bounced, scene, envmap, settings, sampler, shadow_cache, depth);
+    default:
+	return shade<MaterialClass::Dielectric>(point, N, material, direction, bounced, scene, envmap, settings, sampler, shadow_cache, depth);
+    }
+}
+
+template <typename T>
+Vec3<T> cast_ray(const Vec3<T>& origin, const Vec3<T>& direction, const RayCone<T>& cone, const Scene<T>& scene, const Envmap& envmap, const RenderSettings& settings, Sampler& sampler, ShadowCache& shadow_cache, size_t depth) {
+    if (depth > 6) return sample_envmap(envmap, direction, cone.spread, settings.fast_math);
+    T nearest_dist = std::numeric_limits<T>::max();
+    uint32_t primitive = scene.intersect_primitives(origin, direction, nearest_dist);
+    return cast_ray_from_hit(origin, direction, cone, primitive, nearest_dist, scene, envmap, settings, sampler, shadow_cache, depth);
+}
+
+// Ray of a wavefront, weighted by its contribution to the pixel. Rays deeper
+// than cast_ray() recurses only look up the environment.
+template <typename T>
+struct WavefrontRay {
+    Vec3<T> origin;
+    Vec3<T> direction;
+    RayCone<T> cone;
+    T weight;
+    // Index of the pixel in the tile.
+    uint32_t pixel;
+    uint32_t depth;
+    uint32_t key;
+    Sampler sampler;
+};
+
+template <typename T>
+struct WavefrontHit {
+    bool hit = false;
+    Vec3<T> point;
+    Vec3<T> N;
+    Material<T> material;
+    T curvature = 0;
+    // Light received, summed over the lights.
+    T diffuse = 0;
+    T specular = 0;
+};
+
+// Shadow samples of one light at one hit, gathered as in cast_ray(). Area
+// lights in adaptive mode cast their probes first and are pending until
+// they are seen to be in penumbra or not.
+template <typename T>
+struct LightSamples {
+    uint32_t hit = 0;
+    uint32_t light = 0;
+    T weight = 0;
+    T diffuse = 0;
+    T specular = 0;
+    int visible = 0;
+    int count = 0;
+    bool pending = false;
+};
+
+template <typename T>
+struct WavefrontShadowRay {
+    uint32_t samples = 0;
+    uint32_t key = 0;
+    Vec3<T> target;
+    // Light received if nothing is in the way.
+    T diffuse = 0;
+    T specular = 0;
+};
+
+// Direction octant, then the Morton code of the origin on a 16x16x16 grid
+// over bounds: sorting rays by it groups those likely to visit the same
+// nodes of the acceleration structures.
+template <typename T>
+uint32_t ray_sort_key(const Vec3<T>& origin, const Vec3<T>& direction, const AABB<T>& bounds) {
+    uint32_t cell[3];
+    for (int axis = 0;axis < 3;++axis) {
+	T extent = bounds.max[axis] - bounds.min[axis];
+	T x = extent > 0 ? (origin[axis] - bounds.min[axis]) / extent : T(0);
+	cell[axis] = (uint32_t)std::min(T(15), std::max(T(0), x * 16));
+    }
+    uint32_t key = (direction.x < 0) | (direction.y < 0) << 1 | (direction.z < 0) << 2;
+    for (int bit = 3;bit >= 0;--bit) {
+	for (int axis = 0;axis < 3;++axis) {
+	    key = key << 1 | (cell[axis] >> bit & 1);
+	}
+    }
+    return key;
+}
+
+// Sorts items by the ray_sort_key() of the rays origin(item) and
+// direction(item) give.
+template <typename T, typename U, typename O, typename D>
+void sort_rays(U* items, size_t count, O&& origin, D&& direction) {
+    AABB<T> bounds;
+    for (size_t i = 0;i < count;++i) {
+	bounds.extend(origin(items[i]));
+    }
+    for (size_t i = 0;i < count;++i) {
+	items[i].key = ray_sort_key(origin(items[i]), direction(items[i]), bounds);
+    }
+    std::sort(items, items + count, [](const U& a, const U& b) { return a.key < b.key; });
+}
+
+// Traces the rays of a tile one bounce at a time, adding their contribution
+// to sums. Every wave is sorted before its intersections are found in bulk,
+// then the shadow rays of its hits are queued, sorted and traced as a
+// stream, and the reflected and refracted rays make up the next wave. The
+// shading is that of cast_ray(), except that rays of zero weight are
+// dropped and that every ray draws from a sampler of its own.
+template <typename T>
+void trace_wavefront(WavefrontRay<T>* rays, size_t count, Vec3<T>* sums, const Scene<T>& scene, const Envmap& envmap, const RenderSettings& settings, ShadowCache& shadow_cache, Arena& arena) {
+    const T epsilon = ray_epsilon<T>();
+    auto ray_origin = [](const WavefrontRay<T>& ray) { return ray.origin; };
+    auto ray_direction = [](const WavefrontRay<T>& ray) { return ray.direction; };
+
+    while (count > 0) {
+	sort_rays<T>(rays, count, ray_origin, ray_direction);
+	WavefrontHit<T>* hits = arena.allocate_array<WavefrontHit<T>>(count);
+	for (size_t i = 0;i < count;++i) {
+	    const WavefrontRay<T>& ray = rays[i];
+	    WavefrontHit<T>& hit = hits[i];
+	    hit.hit = ray.depth <= 6 && scene_intersect(ray.origin, ray.direction, scene, hit.point, hit.N, hit.material, hit.curvature);
+	    if (!hit.hit) sums[ray.pixel] = sums[ray.pixel] + sample_envmap(envmap, ray.direction, ray.cone.spread, settings.fast_math) * ray.weight;
+	}
+
+	// Lights of every hit. Only the light tree query needs counting
+	// before the lights are visited.
+	size_t sample_count = 0;
+	for (size_t i = 0;i < count;++i) {
+	    if (!hits[i].hit) continue;
+	    if (scene.light_tree.empty()) {
+		sample_count += scene.lights.size();
+	    } else if (settings.light_selection > 0) {
+		sample_count += settings.light_selection;
+	    } else {
+		scene.light_tree.query(scene.lights, hits[i].point, [&](uint32_t) { ++sample_count; });
+	    }
+	}
+	LightSamples<T>* samples = arena.allocate_array<LightSamples<T>>(sample_count);
+	sample_count = 0;
+	for (size_t i = 0;i < count;++i) {
+	    if (!hits[i].hit) continue;
+	    visit_lights(scene, settings, hits[i].point, rays[i].sampler, [&](uint32_t light, T weight) {
+		LightSamples<T>& s = samples[sample_count++];
+		s.hit = (uint32_t)i;
+		s.light = light;
+		s.weight = weight;
+	    });
+	}
+
+	// Shadow rays are cast in two rounds: every sample but the rest of
+	// the budget of lights found in penumbra by their probes.
+	for (int round = 0;round < 2;++round) {
+	    auto budget = [&](const LightSamples<T>& s) {
+		const Light<T>& light = scene.lights[s.light];
+		int n = 0;
+		if (round == 1) {
+		    if (s.pending && s.visible > 0 && s.visible < s.count) n = light.samples;
+		} else if (!light.is_area()) {
+		    return 1;
+		} else if (!settings.adaptive_shadows || light.samples <= penumbra_probes) {
+		    n = light.samples;
+		} else {
+		    n = penumbra_probes;
+		}
+		int side = (int)std::ceil(std::sqrt((T)n));
+		return side * side;
+	    };
+	    size_t shadow_count = 0;
+	    for (size_t k = 0;k < sample_count;++k) {
+		shadow_count += budget(samples[k]);
+	    }
+	    WavefrontShadowRay<T>* shadow_rays = arena.allocate_array<WavefrontShadowRay<T>>(shadow_count);
+	    shadow_count = 0;
+	    for (size_t k = 0;k < sample_count;++k) {
+		LightSamples<T>& s = samples[k];
+		const Light<T>& light = scene.lights[s.light];
+		const WavefrontHit<T>& hit = hits[s.hit];
+		const WavefrontRay<T>& ray = rays[s.hit];
+		const MaterialClass type = settings.material_kernels ? hit.material.type() : MaterialClass::Dielectric;
+		Sampler& sampler = rays[s.hit].sampler;
+		int n = budget(s);
+		int side = (int)std::sqrt((T)n);
+		for (int j = 0;j < n;++j) {
+		    Vec3<T> target = light.position;
+		    if (light.is_area()) {
+			T u = (j % side + sampler.uniform<T>()) / side;
+			T v = (j / side + sampler.uniform<T>()) / side;
+			target = light.sample(hit.point, u, v);
+		    }
+		    ++s.count;
+		    T distance;
+		    Vec3<T> light_direction = direction_to(hit.point, target, settings.fast_math, distance);
+		    T intensity = light.intensity * light.attenuation(distance);
+		    if (intensity <= 0) continue;
+		    WavefrontShadowRay<T>& shadow = shadow_rays[shadow_count++];
+		    shadow.samples = (uint32_t)k;
+		    shadow.target = target;
+		    shadow.diffuse = has_diffuse(type) ? intensity * std::max(T(0), light_direction * hit.N) : T(0);
+		    shadow.specular = has_specular(type) ? shading_pow(std::max(T(0), -reflect(-light_direction, hit.N) * ray.direction), hit.material.specular_exponent, settings.fast_math) * intensity : T(0);
+		}
+		if (round == 0) s.pending = light.is_area() && settings.adaptive_shadows && light.samples > penumbra_probes;
+	    }
+
+	    sort_rays<T>(shadow_rays, shadow_count,
+		      [&](const WavefrontShadowRay<T>& shadow) { return hits[samples[shadow.samples].hit].point; },
+		      [&](const WavefrontShadowRay<T>& shadow) { return shadow.target - hits[samples[shadow.samples].hit].point; });
+	    for (size_t k = 0;k < shadow_count;++k) {
+		const WavefrontShadowRay<T>& shadow = shadow_rays[k];
+		LightSamples<T>& s = samples[shadow.samples];
+		const WavefrontHit<T>& hit = hits[s.hit];
+		if (occluded(hit.point, hit.N, shadow.target, scene, shadow_cache, s.light)) continue;
+		s.diffuse += shadow.diffuse;
+		s.specular += shadow.specular;
+		++s.visible;
+	    }
+	}
+	for (size_t k = 0;k < sample_count;++k) {
+	    const LightSamples<T>& s = samples[k];
+	    hits[s.hit].diffuse += s.weight * s.diffuse / s.count;
+	    hits[s.hit].specular += s.weight * s.specular / s.count;
+	}
+
+	// Local shading, and the next wave.
+	WavefrontRay<T>* next = (WavefrontRay<T>*)arena.allocate(2 * count * sizeof(WavefrontRay<T>), alignof(WavefrontRay<T>));
+	size_t next_count = 0;
+	for (size_t i = 0;i < count;++i) {
+	    if (!hits[i].hit) continue;
+	    WavefrontRay<T>& ray = rays[i];
+	    const WavefrontHit<T>& hit = hits[i];
+	    const Material<T>& material = hit.material;
+	    Vec3<T> color = material.diffuse_color * hit.diffuse * material.albedo()[0] + Vec3<T>(1.0, 1.0, 1.0) * hit.specular * material.albedo()[1];
+	    // Environment shadow rays are traced on the spot rather than
+	    // queued.
+	    if (settings.environment_samples > 0 && !envmap.distribution.empty()) {
+		color = color + component_mul(material.diffuse_color, environment_lighting(hit.point, hit.N, scene, envmap, settings, ray.sampler, shadow_cache)) * material.albedo()[0];
+	    }
+	    sums[ray.pixel] = sums[ray.pixel] + color * ray.weight;
+
+	    RayCone<T> cone = ray.cone.bounce((hit.point - ray.origin).norm(), hit.curvature);
+	    for (int child = 0;child < 2;++child) {
+		T weight = ray.weight * material.albedo()[2 + child];
+		if (weight == 0) continue;
+		Vec3<T> direction = child == 0 ? reflect(ray.direction, hit.N).normalize() : refract(ray.direction, hit.N, material.refraction_index).normalize();
+		Vec3<T> origin = direction * hit.N < 0 ? hit.point - hit.N * epsilon : hit.point + hit.N * epsilon;
+		new (&next[next_count++]) WavefrontRay<T>{origin, direction, cone, weight, ray.pixel, ray.depth + 1, 0, ray.sampler.split()};
+	    }
+	}
+	rays = next;
+	count = next_count;
+    }
+}
+
+// Side of the square tiles the image is rendered in, in pixels.
+const int render_tile_size = 16;
+
+// Besides resizing the framebuffer, rendering takes nothing from the heap
+// once the arenas have grown: per-tile scratch comes from the thread arena.
+// The first sample of a pixel goes through its center and the others are
+// jittered across it, drawing from a Sampler keyed by pixel and sample. The
+// scratch of every sample is released before the next one.
+template <typename T>
+RenderStats render(Framebuffer<T>& framebuffer, int width, int height, const Scene<T>& scene, const Envmap& envmap, const RenderSettings& settings = RenderSettings()) {
+    const double fov{70.0};
+    const int sample_end = settings.first_sample + settings.samples;
+    // Primary rays start as cones as wide as a pixel.
+    const double tan_half_fov = std::tan(fov/2.);
+    const RayCone<T> primary_cone{0, T(2 * tan_half_fov / height)};
+    if (settings.first_sample == 0) framebuffer.resize(width, height);
+    frame_arena().reset();
+    const bool raster = settings.raster_prepass && !settings.wavefront;
+    RasterBins bins;
+    if (raster) bins = bin_primitives(scene, width, height, tan_half_fov, render_tile_size, frame_arena());
+
+    const int tiles_x = (width + render_tile_size - 1) / render_tile_size;
+    const int tiles_y = (height + render_tile_size - 1) / render_tile_size;
+    size_t shadow_rays = 0, occluder_cache_hits = 0, envmap_tiles = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+:shadow_rays, occluder_cache_hits, envmap_tiles)
+    for (int tile = 0;tile < tiles_x * tiles_y;++tile) {
+	const int x0 = tile % tiles_x * render_tile_size, x1 = std::min(width, x0 + render_tile_size);
+	const int y0 = tile / tiles_x * render_tile_size, y1 = std::min(height, y0 + render_tile_size);
+	const int tile_width = x1 - x0;
+
+	// Rays through the pixels of the tile, widened by half a pixel
+	// against rounding, bounded by those through its corners.
+	bool envmap_only = false;
+	if (settings.tile_culling) {
+	    T left = (2 * (x0 - 0.5) / width - 1) * tan_half_fov * width / height;
+	    T right = (2 * (x1 + 0.5) / width - 1) * tan_half_fov * width / height;
+	    T top = -(2 * (y0 - 0.5) / height - 1) * tan_half_fov;
+	    T bottom = -(2 * (y1 + 0.5) / height - 1) * tan_half_fov;
+	    const Vec3<T> corners[4] = {Vec3<T>(left, top, -1), Vec3<T>(right, top, -1), Vec3<T>(right, bottom, -1), Vec3<T>(left, bottom, -1)};
+	    envmap_only = !scene.frustum_may_hit(Frustum<T>(Vec3<T>(0, 0, 0), corners));
+	    envmap_tiles += envmap_only;
+	}
+
+	Arena& arena = thread_arena();
+	Vec3<T>* sums = arena.allocate_array<Vec3<T>>((size_t)tile_width * (y1 - y0));
+	ShadowCache shadow_cache;
+	if (settings.occluder_cache) {
+	    shadow_cache.occluders = arena.allocate_array<uint32_t>(scene.lights.size() + 1);
+	    std::fill(shadow_cache.occluders, shadow_cache.occluders + scene.lights.size() + 1, Scene<T>::no_primitive);
+	}
+	const Arena::Marker sample_start = arena.mark();
+	for (int sample = settings.first_sample;sample < sample_end;++sample) {
+	    WavefrontRay<T>* rays = nullptr;
+	    if (settings.wavefront && !envmap_only) rays = (WavefrontRay<T>*)arena.allocate((size_t)tile_width * (y1 - y0) * sizeof(WavefrontRay<T>), alignof(WavefrontRay<T>));
+	    // Primary rays kept for the prepass, with the samplers they go on with.
+	    Vec3<T>* directions = nullptr;
+	    Sampler* samplers = nullptr;
+	    if (raster && !envmap_only) {
+		directions = arena.allocate_array<Vec3<T>>((size_t)tile_width * (y1 - y0));
+		samplers = (Sampler*)arena.allocate((size_t)tile_width * (y1 - y0) * sizeof(Sampler), alignof(Sampler));
+	    }
+	    for (int j = y0;j < y1;++j) {
+		for (int i = x0;i < x1;++i) {
+		    Sampler sampler((uint32_t)(j * width + i), (uint32_t)sample, settings.seed);
+		    double dx = 0.5, dy = 0.5;
+		    if (sample > 0) {
+			dx = sampler.uniform<double>();
+			dy = sampler.uniform<double>();
+		    }
+		    T x = (2 * (i + dx) / (T)width - 1) * tan_half_fov * width / (T)height;
+		    T y = -(2 * (j + dy) / (T)height - 1) * tan_half_fov;
+		    Vec3<T> dir = Vec3<T>(x, y, -1).normalize();
+		    uint32_t pixel = (uint32_t)((j - y0) * tile_width + i - x0);
+		    if (envmap_only) {
+			sums[pixel] = sums[pixel] + sample_envmap(envmap, dir, primary_cone.spread, settings.fast_math);
+		    } else if (directions) {
+			directions[pixel] = dir;
+			new (&samplers[pixel]) Sampler(sampler);
+		    } else if (settings.wavefront) {
+			new (&rays[pixel]) WavefrontRay<T>{Vec3<T>(0, 0, 0), dir, primary_cone, T(1), pixel, 0, 0, sampler};
+		    } else {
+			sums[pixel] = sums[pixel] + cast_ray(Vec3<T>(0, 0, 0), dir, primary_cone, scene, envmap, settings, sampler, shadow_cache);
+		    }
+		}
+	    }
+	    if (directions) {
+		const size_t pixels = (size_t)tile_width * (y1 - y0);
+		uint32_t* primitives = arena.allocate_array<uint32_t>(pixels);
+		T* depths = arena.allocate_array<T>(pixels);
+		rasterize_tile(scene, bins, x0, y0, x1, y1, directions, primitives, depths);
+		for (size_t pixel = 0;pixel < pixels;++pixel) {
+		    sums[pixel] = sums[pixel] + cast_ray_from_hit(Vec3<T>(0, 0, 0), directions[pixel], primary_cone, primitives[pixel], depths[pixel],
+								  scene, envmap, settings, samplers[pixel], shadow_cache, 0);
+		}
+	    }
+	    if (rays) trace_wavefront(rays, (size_t)tile_width * (y1 - y0), sums, scene, envmap, settings, shadow_cache, arena);
+	    arena.rewind(sample_start);
+	}
+	for (int j = y0;j < y1;++j) {
+	    for (int i = x0;i < x1;++i) {
+		Vec3<T> color = sums[(j - y0) * tile_width + i - x0];
+		if (settings.first_sample > 0) color = color + framebuffer.load(j * width + i) * T(settings.first_sample);
+		framebuffer.store(j * width + i, color * (T(1) / sample_end));
+	    }
+	}
+	shadow_rays += shadow_cache.shadow_rays;
+	occluder_cache_hits += shadow_cache.hits;
+	arena.reset();
+    }
+
+    RenderStats stats;
+    stats.shadow_rays = shadow_rays;
+    stats.occluder_cache_hits = occluder_cache_hits;
+    stats.tiles = (size_t)tiles_x * tiles_y;
+    stats.envmap_tiles = envmap_tiles;
+    return stats;
+}
+
+template <typename T>
+void write_ppm(const char* path, const Framebuffer<T>& framebuffer) {
+    std::ofstream ofs;
+    ofs.open(path);
+    ofs << "P6\n" << framebuffer.width << " " << framebuffer.height << "\n255\n";
+
+    // The image is converted in the frame arena and written at once.
+    const size_t size = framebuffer.size() * 3;
+    char* pixels = frame_arena().allocate_array<char>(size);
+    for (size_t i{0};i < framebuffer.size();++i) {
+	Vec3<T> c = framebuffer.load(i);
+	T max = std::max(c[0], std::max(c[1], c[2]));
+	if (max > 1) c = c * T(1. / max);
+	for (size_t j{0};j < 3;++j) {
+	    pixels[3 * i + j] = (char)(255 * std::max(T(0), std::min(T(1), c[j])));
+	}
+    }
+    ofs.write(pixels, size);
+    ofs.close();
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <cstdint>
+
+// Mixes the bits of a 64-bit key (SplitMix64 finalizer).
+inline uint64_t mix_bits(uint64_t key) {
+    key += 0x9e3779b97f4a7c15ull;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+    return key ^ (key >> 31);
+}
+
+// PCG32 random numbers (O'Neill 2014) for one sample of one pixel. The
+// generator is seeded from the pixel and sample indices alone, so a sample
+// draws the same numbers whatever thread or tile renders it and renders are
+// reproducible bit for bit.
+struct Sampler {
+    Sampler(uint32_t pixel, uint32_t sample, uint32_t seed = 0) {
+	uint64_t key = ((uint64_t)pixel << 32 | sample) ^ mix_bits(seed);
+	state = 0;
+	increment = mix_bits(key + 1) << 1 | 1;
+	next();
+	state += mix_bits(key);
+	next();
+    }
+
+    uint64_t state;
+    uint64_t increment;
+
+    uint32_t next() {
+	uint64_t old = state;
+	state = old * 6364136223846793005ull + increment;
+	uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+	uint32_t rotation = (uint32_t)(old >> 59);
+	return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+    }
+
+    // Generator for a ray spawned from the one this sampler draws for,
+    // seeded from its next numbers.
+    Sampler split() {
+	uint32_t pixel = next();
+	return Sampler(pixel, next());
+    }
+
+    // Uniform in [0, 1), with as many bits as fit the mantissa of float.
+    template <typename T>
+    T uniform() {
+	return T(next() >> 8) * T(1.0 / (1 << 24));
+    }
+};
+
+#endif
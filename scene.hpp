@@ -0,0 +1,340 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "geometry.hpp"
+#include "material.hpp"
+#include "bvh.hpp"
+#include "wide_bvh.hpp"
+#include "grid.hpp"
+#include "sphere.hpp"
+#include "shape.hpp"
+#include "mesh.hpp"
+#include "instance.hpp"
+#include "light.hpp"
+
+// Acceleration structure used for the bounded primitives of a Scene.
+enum class Accelerator {
+    BVH,
+    // Four-wide BVH with compressed nodes, collapsed from the binary one.
+    WideBVH,
+    Grid,
+    // Grid or BVH, picked from the primitive statistics at build time.
+    Auto
+};
+
+template <typename T>
+struct Scene {
+    static const uint32_t no_primitive = std::numeric_limits<uint32_t>::max();
+
+    // Primitives are numbered across the spheres, then the rectangles, the
+    // boxes and the planes. All but the planes are bounded and found through
+    // the acceleration structure.
+    std::vector<Sphere<T>> spheres;
+    std::vector<Rectangle<T>> rectangles;
+    std::vector<Box<T>> boxes;
+    std::vector<Plane<T>> planes;
+    Accelerator accelerator = Accelerator::BVH;
+    // Optional, primitives are tested one by one until it is built.
+    DynamicBVH<T> primitive_bvh;
+    WideBVH<T> wide_primitive_bvh;
+    UniformGrid<T> primitive_grid;
+    // Bottom level of the two-level acceleration structure: geometry shared
+    // by the instances, each with its own BVH in object space.
+    std::vector<Mesh<T>> meshes;
+    std::vector<SphereCluster<T>> sphere_clusters;
+    // Top level: placed copies of the shared geometry and a BVH over their
+    // world space bounds.
+    std::vector<Instance<T>> instances;
+    BVH<T> instance_bvh;
+    std::vector<Light<T>> lights;
+    // Optional, lights are shaded one by one until it is built.
+    LightTree<T> light_tree;
+    // Set by make_baked_scene(): the bounded primitives are then found by
+    // this unrolled test of a scene fixed at compile time, and the
+    // acceleration structures are not used. The primitives above must stay
+    // those it was baked from.
+    uint32_t (*baked_intersect)(const Vec3<T>& origin, const Vec3<T>& direction, T& t) = nullptr;
+
+    size_t bounded_primitive_count() const {
+	return spheres.size() + rectangles.size() + boxes.size();
+    }
+
+    AABB<T> primitive_bounds(uint32_t index) const {
+	if (index < spheres.size()) return spheres[index].bounds();
+	index -= spheres.size();
+	if (index < rectangles.size()) return rectangles[index].bounds();
+	return boxes[index - rectangles.size()].bounds();
+    }
+
+    bool primitive_intersect(uint32_t index, const Vec3<T>& origin, const Vec3<T>& direction, T& t0) const {
+	if (index < spheres.size()) return spheres[index].ray_intersect(origin, direction, t0);
+	index -= spheres.size();
+	if (index < rectangles.size()) return rectangles[index].ray_intersect(origin, direction, t0);
+	index -= rectangles.size();
+	if (index < boxes.size()) return boxes[index].ray_intersect(origin, direction, t0);
+	return planes[index - boxes.size()].ray_intersect(origin, direction, t0);
+    }
+
+    // Reciprocal of the radius of curvature of a primitive, 0 if it is flat.
+    T primitive_curvature(uint32_t index) const {
+	return index < spheres.size() ? 1 / spheres[index].radius : 0;
+    }
+
+    // Normal, texture coordinates and material at a point on a primitive.
+    void primitive_surface(uint32_t index, const Vec3<T>& hit, Vec3<T>& N, Vec2<T>& uv, const Material<T>*& material) const {
+	if (index < spheres.size()) {
+	    const Sphere<T>& sphere = spheres[index];
+	    N = (hit - sphere.center).normalize();
+	    uv = Vec2<T>(std::atan2(N.z, N.x) * sphere.radius, std::acos(std::max(T(-1), std::min(T(1), N.y))) * sphere.radius);
+	    material = &sphere.material;
+	    return;
+	}
+	index -= spheres.size();
+	if (index < rectangles.size()) {
+	    const Rectangle<T>& rectangle = rectangles[index];
+	    N = rectangle.normal;
+	    uv = rectangle.uv(hit);
+	    material = &rectangle.material;
+	    return;
+	}
+	index -= rectangles.size();
+	if (index < boxes.size()) {
+	    const Box<T>& box = boxes[index];
+	    N = box.normal(hit);
+	    uv = box.uv(hit);
+	    material = &box.material;
+	    return;
+	}
+	const Plane<T>& plane = planes[index - boxes.size()];
+	N = plane.normal;
+	uv = plane.uv(hit);
+	material = &plane.material;
+    }
+
+    // Auto is replaced by the structure it picked.
+    void build_accelerator() {
+	std::vector<AABB<T>> bounds(bounded_primitive_count());
+	for (uint32_t i = 0;i < bounds.size();++i) {
+	    bounds[i] = primitive_bounds(i);
+	}
+	if (accelerator == Accelerator::Auto) {
+	    accelerator = grid_suits(bounds) ? Accelerator::Grid : Accelerator::BVH;
+	}
+	if (accelerator == Accelerator::Grid) {
+	    primitive_grid.build(bounds);
+	    return;
+	}
+	primitive_bvh.build(bounds);
+	if (accelerator == Accelerator::WideBVH) {
+	    wide_primitive_bvh.build(primitive_bvh.bvh);
+	}
+    }
+
+    // Applies one frame of motion and updates the BVH, if any, by refitting
+    // it or rebuilding it when its quality got too low. Returns true if the
+    // BVH was rebuilt. The wide BVH is collapsed again from the updated
+    // binary one, and the grid is always rebuilt.
+    bool move_spheres(const std::vector<SphereTransform<T>>& transforms) {
+	std::vector<uint32_t> changed;
+	changed.reserve(transforms.size());
+	for (const auto& motion : transforms) {
+	    Sphere<T>& sphere = spheres[motion.sphere];
+	    sphere.center = motion.transform.transform_point(sphere.center);
+	    sphere.radius *= motion.transform.transform_vector(Vec3<T>(1, 0, 0)).norm();
+	    changed.push_back(motion.sphere);
+	}
+
+	if (accelerator == Accelerator::Grid && !primitive_grid.empty()) {
+	    build_accelerator();
+	    return true;
+	}
+	if (primitive_bvh.empty()) return false;
+	bool rebuilt = primitive_bvh.update(changed, [&](uint32_t i) { return primitive_bounds(i); });
+	if (accelerator == Accelerator::WideBVH) {
+	    wide_primitive_bvh.build(primitive_bvh.bvh);
+	}
+	return rebuilt;
+    }
+
+    // t holds the distance of the closest hit found so far and is updated
+    // when a closer primitive is hit. Returns the index of that primitive,
+    // or no_primitive.
+    uint32_t intersect_primitives(const Vec3<T>& origin, const Vec3<T>& direction, T& t) const {
+	uint32_t hit_primitive = no_primitive;
+	auto intersect = [&](uint32_t index, T& t_max) {
+	    T dist;
+	    if (primitive_intersect(index, origin, direction, dist) && dist < t_max) {
+		t_max = dist;
+		hit_primitive = index;
+		return true;
+	    }
+	    return false;
+	};
+	if (baked_intersect) {
+	    hit_primitive = baked_intersect(origin, direction, t);
+	} else if (accelerator == Accelerator::Grid && !primitive_grid.empty()) {
+	    primitive_grid.traverse(origin, direction, t, intersect);
+	} else if (accelerator == Accelerator::WideBVH && !wide_primitive_bvh.empty()) {
+	    wide_primitive_bvh.traverse(origin, direction, t, intersect);
+	} else if (!primitive_bvh.empty()) {
+	    primitive_bvh.bvh.traverse(origin, direction, t, intersect);
+	} else {
+	    for (uint32_t i = 0;i < bounded_primitive_count();++i) {
+		intersect(i, t);
+	    }
+	}
+	for (uint32_t i = 0;i < planes.size();++i) {
+	    intersect((uint32_t)bounded_primitive_count() + i, t);
+	}
+	return hit_primitive;
+    }
+
+    // False only if no ray of the frustum can hit a primitive or an
+    // instance, which the acceleration structures tell from their boxes.
+    bool frustum_may_hit(const Frustum<T>& frustum) const {
+	auto overlaps = [&](const AABB<T>& box) { return frustum.overlaps(box); };
+	if (accelerator == Accelerator::Grid && !primitive_grid.empty()) {
+	    if (overlaps(primitive_grid.bounds)) return true;
+	} else if (!baked_intersect && !primitive_bvh.empty()) {
+	    if (primitive_bvh.bvh.any_leaf(overlaps)) return true;
+	} else {
+	    for (uint32_t i = 0;i < bounded_primitive_count();++i) {
+		if (overlaps(primitive_bounds(i))) return true;
+	    }
+	}
+	if (instance_bvh.any_leaf(overlaps)) return true;
+	for (const Plane<T>& plane : planes) {
+	    if (frustum.crosses_plane(plane.point, plane.normal)) return true;
+	}
+	return false;
+    }
+
+    AABB<T> instance_bounds(const Instance<T>& instance) const {
+	const AABB<T>& bounds = instance.type == InstanceGeometry::Mesh ? meshes[instance.geometry].bounds() : sphere_clusters[instance.geometry].bounds();
+	return transform_bounds(instance.object_to_world, bounds);
+    }
+
+    // Small light sets are shaded one by one, the tree is only built past
+    // min_tree_lights.
+    static const size_t min_tree_lights = 16;
+    void build_light_tree() {
+	if (lights.size() >= min_tree_lights) light_tree.build(lights);
+    }
+
+    // The bottom level BVHs must be built first.
+    void build_instance_bvh() {
+	std::vector<AABB<T>> primitive_bounds(instances.size());
+	for (size_t i = 0;i < instances.size();++i) {
+	    primitive_bounds[i] = instance_bounds(instances[i]);
+	}
+	instance_bvh.build(primitive_bounds);
+    }
+
+    // t holds the distance of the closest hit found so far and is updated,
+    // along with the world space normal and the material, when a closer
+    // instance is hit.
+    bool intersect_instances(const Vec3<T>& origin, const Vec3<T>& direction, T& t, Vec3<T>& N, const Material<T>*& material) const {
+	return instance_bvh.traverse(origin, direction, t, [&](uint32_t index, T& t_max) {
+	    const Instance<T>& instance = instances[index];
+	    Vec3<T> object_origin = instance.world_to_object.transform_point(origin);
+	    Vec3<T> object_direction = instance.world_to_object.transform_vector(direction);
+	    // Distances are rescaled rather than keeping an unnormalized
+	    // direction, which the sphere test does not support.
+	    T scale = object_direction.norm();
+	    object_direction = object_direction / scale;
+
+	    T object_t = t_max * scale;
+	    Vec3<T> object_normal;
+	    bool hit;
+	    if (instance.type == InstanceGeometry::Mesh) {
+		const Mesh<T>& mesh = meshes[instance.geometry];
+		hit = mesh.ray_intersect(object_origin, object_direction, object_t, object_normal);
+		if (hit) material = &mesh.material;
+	    } else {
+		hit = sphere_clusters[instance.geometry].ray_intersect(object_origin, object_direction, object_t, object_normal, material);
+	    }
+
+	    if (hit) {
+		t_max = object_t / scale;
+		N = instance.world_to_object.transform_normal(object_normal).normalize();
+	    }
+	    return hit;
+	});
+    }
+};
+
+// Replaces the point lights of the default scene by area lights of about
+// the given size: a rectangle for the first one and spheres for the others.
+template <typename T>
+void make_area_lights(Scene<T>& scene, T size, int samples) {
+    for (size_t i = 0;i < scene.lights.size();++i) {
+	const Light<T>& light = scene.lights[i];
+	if (i == 0) {
+	    Vec3<T> corner = light.position - Vec3<T>(size, 0, size) * T(0.5);
+	    scene.lights[i] = Light<T>::rectangle(corner, Vec3<T>(size, 0, 0), Vec3<T>(0, 0, size), light.intensity, samples);
+	} else {
+	    scene.lights[i] = Light<T>::sphere(light.position, size * T(0.5), light.intensity, samples);
+	}
+    }
+}
+
+// A lighting rig: a grid of about count point lights of limited range,
+// hanging over the ground.
+template <typename T>
+void add_light_rig(Scene<T>& scene, int count) {
+    if (count <= 0) return;
+
+    int side = std::max(1, (int)std::round(std::sqrt((T)count)));
+    T spacing = T(40) / side;
+    for (int i = 0;i < side;++i) {
+	for (int j = 0;j < side;++j) {
+	    Light<T> light(Vec3<T>(-20 + (i + T(0.5)) * spacing, T(-1), -50 + (j + T(0.5)) * spacing), T(0.3));
+	    light.range = 3 * spacing;
+	    scene.lights.push_back(light);
+	}
+    }
+}
+
+// A tree made of a trunk and a crown of spheres, standing on y = 0.
+template <typename T>
+SphereCluster<T> make_tree_cluster() {
+    Material<T> bark(1.0, Vec4<T>(0.9, 0.1, 0.0, 0.0), Vec3<T>(0.25, 0.15, 0.05), 10);
+    Material<T> leaves(1.0, Vec4<T>(0.8, 0.2, 0.0, 0.0), Vec3<T>(0.1, 0.35, 0.1), 20);
+
+    SphereCluster<T> tree;
+    for (int i = 0;i < 4;++i) {
+	tree.spheres.push_back(Sphere<T>(Vec3<T>(0, 0.25 + 0.4 * i, 0), 0.25, bark));
+    }
+    tree.spheres.push_back(Sphere<T>(Vec3<T>(0, 2.2, 0), 0.8, leaves));
+    for (int i = 0;i < 5;++i) {
+	T angle = 2 * M_PI * i / 5;
+	tree.spheres.push_back(Sphere<T>(Vec3<T>(0.6 * std::cos(angle), 1.8, 0.6 * std::sin(angle)), 0.55, leaves));
+    }
+    tree.build_bvh();
+    return tree;
+}
+
+// Scatters count instances of one shared tree over the checkerboard.
+template <typename T>
+void add_forest(Scene<T>& scene, int count) {
+    if (count <= 0) return;
+
+    uint32_t cluster = (uint32_t)scene.sphere_clusters.size();
+    scene.sphere_clusters.push_back(make_tree_cluster<T>());
+
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<T> x(-19, 19), z(-49, -11), scale(0.6, 1.2), yaw(0, 2 * M_PI);
+    for (int i = 0;i < count;++i) {
+	Transform<T> transform = Transform<T>::translation(Vec3<T>(x(generator), -4, z(generator)))
+	    * Transform<T>::rotation_y(yaw(generator)) * Transform<T>::scaling(scale(generator));
+	scene.instances.push_back(Instance<T>(InstanceGeometry::SphereCluster, cluster, transform));
+    }
+}
+
+#endif
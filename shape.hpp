@@ -0,0 +1,159 @@
+#ifndef SHAPE_HPP
+#define SHAPE_HPP
+
+#include <cmath>
+#include <limits>
+
+#include "geometry.hpp"
+#include "material.hpp"
+#include "bvh.hpp"
+
+// Planar and box primitives. Like spheres they report the distance of their
+// first hit in front of the origin, and then give the normal and texture
+// coordinates of a point on their surface. Texture coordinates are in world
+// units.
+
+// Rays closer to parallel to a plane than this miss it.
+template <typename T> constexpr T parallel_epsilon() { return T(1e-6); }
+
+// Infinite plane, which no acceleration structure can bound.
+template <typename T>
+struct Plane {
+    Vec3<T> point;
+    Vec3<T> normal;
+    // Texture axes, orthogonal to the normal.
+    Vec3<T> tangent;
+    Vec3<T> bitangent;
+    Material<T> material;
+
+    Plane(const Vec3<T>& p, const Vec3<T>& n, const Material<T>& m) : point(p), normal(n), material(m) {
+	normal.normalize();
+	Vec3<T> axis = std::fabs(normal.x) < T(0.9) ? Vec3<T>(1, 0, 0) : Vec3<T>(0, 1, 0);
+	tangent = cross(axis, normal).normalize();
+	bitangent = cross(normal, tangent);
+    }
+
+    bool ray_intersect(const Vec3<T>& origin, const Vec3<T>& direction, T& t0) const {
+	T denominator = direction * normal;
+	if (std::fabs(denominator) < parallel_epsilon<T>()) return false;
+	t0 = ((point - origin) * normal) / denominator;
+	return t0 > 0;
+    }
+
+    Vec2<T> uv(const Vec3<T>& hit) const {
+	Vec3<T> local = hit - point;
+	return Vec2<T>(local * tangent, local * bitangent);
+    }
+};
+
+// Distance to the hit of a ray on the rectangle spanned by two perpendicular
+// edges from a corner, of unit normal cross(edge_u, edge_v).
+template <typename T>
+inline bool rectangle_intersect(const Vec3<T>& corner, const Vec3<T>& edge_u, const Vec3<T>& edge_v, const Vec3<T>& normal,
+				const Vec3<T>& origin, const Vec3<T>& direction, T& t0) {
+    T denominator = direction * normal;
+    if (std::fabs(denominator) < parallel_epsilon<T>()) return false;
+    T t = ((corner - origin) * normal) / denominator;
+    if (t <= 0) return false;
+
+    Vec3<T> local = origin + direction * t - corner;
+    T u = local * edge_u, v = local * edge_v;
+    if (u < 0 || u > edge_u * edge_u || v < 0 || v > edge_v * edge_v) return false;
+    t0 = t;
+    return true;
+}
+
+// Bounded plane spanned by two perpendicular edges from a corner. The normal
+// is cross(edge_u, edge_v).
+template <typename T>
+struct Rectangle {
+    Vec3<T> corner;
+    Vec3<T> edge_u;
+    Vec3<T> edge_v;
+    Vec3<T> normal;
+    Material<T> material;
+
+    Rectangle(const Vec3<T>& corner, const Vec3<T>& edge_u, const Vec3<T>& edge_v, const Material<T>& m) :
+	corner(corner), edge_u(edge_u), edge_v(edge_v), normal(cross(edge_u, edge_v).normalize()), material(m) {}
+
+    bool ray_intersect(const Vec3<T>& origin, const Vec3<T>& direction, T& t0) const {
+	return rectangle_intersect(corner, edge_u, edge_v, normal, origin, direction, t0);
+    }
+
+    Vec2<T> uv(const Vec3<T>& hit) const {
+	Vec3<T> local = hit - corner;
+	return Vec2<T>(local * edge_u / edge_u.norm(), local * edge_v / edge_v.norm());
+    }
+
+    AABB<T> bounds() const {
+	AABB<T> box;
+	box.extend(corner);
+	box.extend(corner + edge_u);
+	box.extend(corner + edge_v);
+	box.extend(corner + edge_u + edge_v);
+	return box;
+    }
+};
+
+// Axis-aligned box, solid: rays starting inside hit its faces from within.
+template <typename T>
+struct Box {
+    AABB<T> box;
+    Material<T> material;
+
+    Box(const Vec3<T>& min, const Vec3<T>& max, const Material<T>& m) : box(min, max), material(m) {}
+
+    bool ray_intersect(const Vec3<T>& origin, const Vec3<T>& direction, T& t0) const {
+	T t_near = -std::numeric_limits<T>::max(), t_far = std::numeric_limits<T>::max();
+	for (int axis = 0;axis < 3;++axis) {
+	    if (std::fabs(direction[axis]) < parallel_epsilon<T>()) {
+		if (origin[axis] < box.min[axis] || origin[axis] > box.max[axis]) return false;
+		continue;
+	    }
+	    T inv = T(1) / direction[axis];
+	    T t1 = (box.min[axis] - origin[axis]) * inv;
+	    T t2 = (box.max[axis] - origin[axis]) * inv;
+	    t_near = std::max(t_near, std::min(t1, t2));
+	    t_far = std::min(t_far, std::max(t1, t2));
+	}
+	if (t_near > t_far || t_far <= 0) return false;
+	t0 = t_near > 0 ? t_near : t_far;
+	return true;
+    }
+
+    // The face of the hit is the axis along which it lies the furthest
+    // from the center, relative to the size of the box.
+    int face_axis(const Vec3<T>& hit) const {
+	Vec3<T> half = (box.max - box.min) * T(0.5);
+	Vec3<T> local = hit - box.center();
+	int axis = 0;
+	T best = -1;
+	for (int i = 0;i < 3;++i) {
+	    T distance = half[i] > 0 ? std::fabs(local[i]) / half[i] : std::numeric_limits<T>::max();
+	    if (distance > best) {
+		best = distance;
+		axis = i;
+	    }
+	}
+	return axis;
+    }
+
+    Vec3<T> normal(const Vec3<T>& hit) const {
+	int axis = face_axis(hit);
+	Vec3<T> N(0, 0, 0);
+	N[axis] = hit[axis] < box.center()[axis] ? -1 : 1;
+	return N;
+    }
+
+    Vec2<T> uv(const Vec3<T>& hit) const {
+	int axis = face_axis(hit);
+	Vec3<T> local = hit - box.min;
+	return Vec2<T>(local[(axis + 1) % 3], local[(axis + 2) % 3]);
+    }
+
+    AABB<T> bounds() const {
+	return box;
+    }
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef SPHERE_HPP
+#define SPHERE_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "geometry.hpp"
+#include "material.hpp"
+#include "bvh.hpp"
+
+// Distance to the first hit of a ray on a sphere in front of its origin.
+// Baked scenes call it with constant centers and radii.
+template <typename T>
+inline bool sphere_intersect(const Vec3<T>& center, T radius, const Vec3<T>& origin, const Vec3<T>& direction, T& t0) {
+    Vec3<T> L = center - origin;
+    T tca = L * direction;
+    T d2 = L * L - tca * tca;
+    if (d2 > radius * radius) return false;
+    T thc = std::sqrt(radius * radius - d2);
+    t0 = tca - thc;
+    T t1 = tca + thc;
+    if (t0 < 0) t0 = t1;
+    if (t0 < 0) return false;
+    return true;
+}
+
+template <typename T>
+struct Sphere {
+    Vec3<T> center;
+    T radius;
+    Material<T> material;
+
+    Sphere(const Vec3<T>& c, const T& r, const Material<T>& m) : center(c), radius(r), material(m) {}
+
+    bool ray_intersect(const Vec3<T>& origin, const Vec3<T>& direction, T& t0) const {
+	return sphere_intersect(center, radius, origin, direction, t0);
+    }
+
+    AABB<T> bounds() const {
+	Vec3<T> extent(radius, radius, radius);
+	return AABB<T>(center - extent, center + extent);
+    }
+};
+
+// Per-frame motion of one sphere, applied to its current position. Only
+// uniform scales are supported, the radius follows the scale of the x axis.
+template <typename T>
+struct SphereTransform {
+    uint32_t sphere;
+    Transform<T> transform;
+};
+
+// A group of spheres with its own BVH, which instances can share.
+template <typename T>
+struct SphereCluster {
+    std::vector<Sphere<T>> spheres;
+    BVH<T> bvh;
+
+    AABB<T> bounds() const {
+	return bvh.nodes.empty() ? AABB<T>() : bvh.nodes[0].bounds;
+    }
+
+    void build_bvh() {
+	std::vector<AABB<T>> primitive_bounds(spheres.size());
+	for (size_t i = 0;i < spheres.size();++i) {
+	    primitive_bounds[i] = spheres[i].bounds();
+	}
+	bvh.build(primitive_bounds);
+    }
+
+    // t holds the distance of the closest hit found so far and is updated,
+    // along with the normal and material, when a closer sphere is hit.
+    bool ray_intersect(const Vec3<T>& origin, const Vec3<T>& direction, T& t, Vec3<T>& N, const Material<T>*& material) const {
+	const Sphere<T>* hit_sphere = nullptr;
+	bvh.traverse(origin, direction, t, [&](uint32_t index, T& t_max) {
+	    T dist;
+	    if (spheres[index].ray_intersect(origin, direction, dist) && dist < t_max) {
+		t_max = dist;
+		hit_sphere = &spheres[index];
+		return true;
+	    }
+	    return false;
+	});
+
+	if (hit_sphere) {
+	    N = (origin + direction * t - hit_sphere->center).normalize();
+	    material = &hit_sphere->material;
+	}
+	return hit_sphere != nullptr;
+    }
+
+    size_t memory_bytes() const {
+	return spheres.capacity() * sizeof(Sphere<T>) + bvh.memory_bytes();
+    }
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef WIDE_BVH_HPP
+#define WIDE_BVH_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <emmintrin.h>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+
+// Four-wide BVH node packed in one cache line. Child boxes are quantized to
+// 8 bits per axis on a grid of power of two step anchored at the corner of
+// the node box, and always round outwards.
+struct alignas(64) WideBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    // Bit i is set if child i exists.
+    uint8_t valid_mask;
+    uint8_t lo[3][4];
+    uint8_t hi[3][4];
+    // Inner children: index of the child node. Leaves: offset of the first
+    // primitive in WideBVH::indices.
+    uint32_t child[4];
+    // Number of primitives of a leaf child, 0 for inner children.
+    uint8_t count[4];
+};
+
+static_assert(sizeof(WideBVHNode) == 64, "WideBVHNode must fill exactly one cache line");
+
+// Quantized boxes are decoded with a few float roundings, so ray/box
+// distances are compared with this much slack to stay conservative.
+const float wide_bvh_slack = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+inline float exp2_int(int exponent) {
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float result;
+    std::memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+inline __m128 unpack_quantized(const uint8_t* quantized) {
+    int32_t packed;
+    std::memcpy(&packed, quantized, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+
+// Tests the four children of node at once. Returns the mask of the children
+// hit before t_max, and their entry distances in t_near.
+inline int intersect_children(const WideBVHNode& node, const Vec3f& origin, const Vec3f& inv_direction, float t_max, float t_near[4]) {
+    __m128 near = _mm_setzero_ps();
+    __m128 far = _mm_set1_ps(t_max);
+    for (int axis = 0;axis < 3;++axis) {
+	__m128 a = _mm_set1_ps((node.origin[axis] - origin[axis]) * inv_direction[axis]);
+	__m128 b = _mm_set1_ps(exp2_int(node.exponent[axis]) * inv_direction[axis]);
+	__m128 t_lo = _mm_add_ps(a, _mm_mul_ps(unpack_quantized(node.lo[axis]), b));
+	__m128 t_hi = _mm_add_ps(a, _mm_mul_ps(unpack_quantized(node.hi[axis]), b));
+	near = _mm_max_ps(near, _mm_min_ps(t_lo, t_hi));
+	far = _mm_min_ps(far, _mm_max_ps(t_lo, t_hi));
+    }
+    far = _mm_mul_ps(far, _mm_set1_ps(wide_bvh_slack));
+    _mm_storeu_ps(t_near, near);
+    return _mm_movemask_ps(_mm_cmple_ps(near, far)) & node.valid_mask;
+}
+
+// Scalar version for other precisions, where decoding is exact.
+template <typename T>
+int intersect_children(const WideBVHNode& node, const Vec3<T>& origin, const Vec3<T>& inv_direction, T t_max, T t_near[4]) {
+    int mask = 0;
+    for (int i = 0;i < 4;++i) {
+	T near = 0, far = t_max;
+	for (int axis = 0;axis < 3;++axis) {
+	    T a = ((T)node.origin[axis] - origin[axis]) * inv_direction[axis];
+	    T b = (T)exp2_int(node.exponent[axis]) * inv_direction[axis];
+	    T t_lo = a + node.lo[axis][i] * b;
+	    T t_hi = a + node.hi[axis][i] * b;
+	    near = std::max(near, std::min(t_lo, t_hi));
+	    far = std::min(far, std::max(t_lo, t_hi));
+	}
+	t_near[i] = near;
+	if (near <= far * (T)wide_bvh_slack) mask |= 1 << i;
+    }
+    return mask & node.valid_mask;
+}
+
+// Four-wide BVH collapsed from a binary one, sharing its leaves.
+template <typename T>
+struct WideBVH {
+    static const int stack_size = 256;
+
+    std::vector<WideBVHNode> nodes;
+    std::vector<uint32_t> indices;
+
+    bool empty() const {
+	return nodes.empty();
+    }
+
+    void build(const BVH<T>& bvh) {
+	nodes.clear();
+	indices = bvh.indices;
+	if (bvh.nodes.empty()) return;
+
+	nodes.reserve(bvh.nodes.size() / 2 + 1);
+	nodes.emplace_back();
+	collapse(bvh, 0, 0);
+	nodes.shrink_to_fit();
+    }
+
+    // Same contract as BVH::traverse.
+    template <typename F>
+    bool traverse(const Vec3<T>& origin, const Vec3<T>& direction, T& t_max, F&& intersect) const {
+	if (nodes.empty()) return false;
+
+	// Avoids infinities, which the quantized box decoding cannot handle.
+	const T tiny = (T)1e-30;
+	Vec3<T> inv_direction;
+	for (int axis = 0;axis < 3;++axis) {
+	    T d = direction[axis];
+	    inv_direction[axis] = T(1) / (std::fabs(d) < tiny ? std::copysign(tiny, d) : d);
+	}
+
+	struct Entry {
+	    uint32_t index;
+	    uint32_t count;
+	    T t;
+	};
+	Entry stack[stack_size];
+	int stack_top = 0;
+	stack[stack_top++] = {0, 0, 0};
+	bool hit = false;
+	while (stack_top > 0) {
+	    const Entry entry = stack[--stack_top];
+	    if (entry.t > t_max) continue;
+
+	    if (entry.count != 0) {
+		for (uint32_t i = entry.index;i < entry.index + entry.count;++i) {
+		    hit |= intersect(indices[i], t_max);
+		}
+		continue;
+	    }
+
+	    const WideBVHNode& node = nodes[entry.index];
+	    T t_near[4];
+	    int mask = intersect_children(node, origin, inv_direction, t_max, t_near);
+
+	    // Pushes the hit children sorted by decreasing distance, so that
+	    // the nearest one is popped first.
+	    Entry hits[4];
+	    int hit_count = 0;
+	    for (int i = 0;i < 4;++i) {
+		if (!(mask & (1 << i))) continue;
+		Entry child{node.child[i], node.count[i], t_near[i]};
+		int j = hit_count++;
+		while (j > 0 && hits[j - 1].t < child.t) {
+		    hits[j] = hits[j - 1];
+		    --j;
+		}
+		hits[j] = child;
+	    }
+	    for (int i = 0;i < hit_count;++i) {
+		stack[stack_top++] = hits[i];
+	    }
+	}
+	return hit;
+    }
+
+    size_t memory_bytes() const {
+	return nodes.capacity() * sizeof(WideBVHNode) + indices.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    void collapse(const BVH<T>& bvh, uint32_t binary_index, uint32_t wide_index) {
+	// Opens the inner child with the largest area until four children
+	// are gathered.
+	const BVHNode<T>& binary = bvh.nodes[binary_index];
+	uint32_t children[4];
+	int child_count = 0;
+	if (binary.is_leaf()) {
+	    children[child_count++] = binary_index;
+	} else {
+	    children[child_count++] = binary.first;
+	    children[child_count++] = binary.first + 1;
+	    while (child_count < 4) {
+		int best = -1;
+		T best_area = -1;
+		for (int i = 0;i < child_count;++i) {
+		    const BVHNode<T>& child = bvh.nodes[children[i]];
+		    if (!child.is_leaf() && child.bounds.surface_area() > best_area) {
+			best = i;
+			best_area = child.bounds.surface_area();
+		    }
+		}
+		if (best == -1) break;
+
+		uint32_t opened = children[best];
+		children[best] = bvh.nodes[opened].first;
+		children[child_count++] = bvh.nodes[opened].first + 1;
+	    }
+	}
+
+	WideBVHNode node;
+	std::memset(&node, 0, sizeof(node));
+	quantize_frame(binary.bounds, node);
+
+	uint32_t inner[4];
+	int inner_count = 0;
+	for (int i = 0;i < child_count;++i) {
+	    const BVHNode<T>& child = bvh.nodes[children[i]];
+	    for (int axis = 0;axis < 3;++axis) {
+		double step = exp2_int(node.exponent[axis]);
+		double lo = std::floor(((double)child.bounds.min[axis] - node.origin[axis]) / step);
+		double hi = std::ceil(((double)child.bounds.max[axis] - node.origin[axis]) / step);
+		node.lo[axis][i] = (uint8_t)std::max(0.0, std::min(255.0, lo));
+		node.hi[axis][i] = (uint8_t)std::max(0.0, std::min(255.0, hi));
+	    }
+	    node.valid_mask |= 1 << i;
+	    if (child.is_leaf()) {
+		node.child[i] = child.first;
+		node.count[i] = (uint8_t)child.count;
+	    } else {
+		node.child[i] = (uint32_t)nodes.size();
+		nodes.emplace_back();
+		inner[inner_count++] = i;
+	    }
+	}
+	nodes[wide_index] = node;
+
+	for (int i = 0;i < inner_count;++i) {
+	    collapse(bvh, children[inner[i]], node.child[inner[i]]);
+	}
+    }
+
+    // Picks the origin and per-axis steps so that 255 steps from the origin
+    // cover the whole box.
+    static void quantize_frame(const AABB<T>& bounds, WideBVHNode& node) {
+	for (int axis = 0;axis < 3;++axis) {
+	    double min = bounds.min[axis];
+	    double max = bounds.max[axis];
+	    float origin = (float)min;
+	    if (origin > min) origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+	    int exponent = -126;
+	    double extent = max - origin;
+	    if (extent > 0) {
+		exponent = std::max(-126, (int)std::ceil(std::log2(extent / 255.0)));
+		while (origin + 255.0 * exp2_int(exponent) < max) ++exponent;
+	    }
+	    node.origin[axis] = origin;
+	    node.exponent[axis] = (int8_t)exponent;
+	}
+    }
+};
+
+#endif